@@ -8,37 +8,137 @@
  */
 
 #include "AlphaHistogram.h"
+#include "TraceReader.h"
 
+#include <algorithm>
 #include <iostream>
-#include <fstream>
+#include <thread>
+#include <utility>
 
-AlphaHistogram::AlphaHistogram(const std::string &file_name) {
-  // Initialize histogram size and set to all 0
-  histogram.resize(char_range, 0);
+namespace {
 
-  // Open the input file
-  std::ifstream text_file;
-  text_file.open(file_name);
-  if (text_file.fail()) {
+// Smallest piece of a mapped file worth giving its own thread
+const size_t kMinChunk = 1 << 20;
+
+// Buffers shorter than this are counted directly, without the split tables
+const size_t kSmallBuffer = 256;
+
+// Size of blocks read from a stream
+const size_t kStreamBlock = 1 << 16;
+
+}  // namespace
+
+AlphaHistogram::AlphaHistogram(void)
+: histogram(char_range, 0) {
+}
+
+AlphaHistogram::AlphaHistogram(const std::string &file_name, unsigned threads)
+: histogram(char_range, 0) {
+  // Open the input file (memory-mapped if possible)
+  TraceReader text_file(file_name);
+  if (!text_file.is_open()) {
     std::cerr << "ERROR: file not found: " << file_name << "\n";
     exit(2);
   }
 
-  // Read each character and update histogram
-  unsigned char c;
-  while (text_file >> c) {                  // while another character in file
-    if (c >= low_char && c <= high_char) {  // if in range
-      ++histogram[c - low_char];
+  const char *data = text_file.get_mapped_data();
+  if (data != nullptr) {
+    // Split the mapping into one chunk per thread, each counted into its own
+    // histogram and merged afterwards
+    size_t size = text_file.get_mapped_size();
+    if (threads == 0) {
+      threads = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+    size_t chunks = std::max<size_t>(std::min<size_t>(threads, size / kMinChunk), 1);
+    std::vector<AlphaHistogram> partial(chunks - 1);
+    std::vector<std::thread> pool;
+    for (size_t i = 1; i < chunks; ++i) {
+      const char *begin = data + size * i / chunks;
+      const char *end = data + size * (i + 1) / chunks;
+      AlphaHistogram *counts = &partial[i - 1];
+      pool.push_back(std::thread([counts, begin, end] { counts->Add(begin, end - begin); }));
+    }
+    Add(data, size / chunks);
+    for (size_t i = 0; i < pool.size(); ++i) {
+      pool[i].join();
+      Merge(partial[i]);
+    }
+  } else {
+    // Not mappable (pipe or special file): count it a line at a time. Line
+    // ends are never in range.
+    const char *line;
+    size_t length;
+    while (text_file.NextLine(line, length)) {
+      Add(line, length);
+    }
+    
+    // If terminated for reason other than end of file
+    if (text_file.fail()) {
+      std::cerr << "ERROR: failure while reading file: " << file_name << "\n";
+      exit(2);
     }
   }
-  
-  // If terminated for reason other than end of file
-  if (!text_file.eof()) {
-    std::cerr << "ERROR: failure while reading file: " << file_name << "\n";
-    exit(2);
+}
+
+AlphaHistogram::AlphaHistogram(AlphaHistogram &&orig)
+: histogram(std::move(orig.histogram)) {
+  orig.histogram.assign(char_range, 0);
+}
+
+AlphaHistogram &AlphaHistogram::operator=(AlphaHistogram &&orig) {
+  if (this != &orig) {
+    histogram = std::move(orig.histogram);
+    orig.histogram.assign(char_range, 0);
   }
-  
-  text_file.close();
+  return *this;
+}
+
+void AlphaHistogram::Add(const void *data, size_t size) {
+  const unsigned char *p = static_cast<const unsigned char*>(data);
+  const unsigned char *end = p + size;
+  if (size < kSmallBuffer) {
+    for (; p < end; ++p) {
+      if (*p >= low_char && *p <= high_char) {  // if in range
+        ++histogram[*p - low_char];
+      }
+    }
+    return;
+  }
+
+  /* Count every byte value, consecutive bytes going to four separate
+   * tables so a run of one character doesn't make each increment wait for
+   * the previous one to be stored; then add up the ones in range */
+  unsigned long table[4][256] = {};
+  for (; end - p >= 4; p += 4) {
+    ++table[0][p[0]];
+    ++table[1][p[1]];
+    ++table[2][p[2]];
+    ++table[3][p[3]];
+  }
+  for (; p < end; ++p) {
+    ++table[0][*p];
+  }
+  for (size_t c = low_char; c <= high_char; ++c) {
+    histogram[c - low_char] += table[0][c] + table[1][c] + table[2][c] + table[3][c];
+  }
+}
+
+bool AlphaHistogram::Add(std::istream &in) {
+  std::vector<char> block(kStreamBlock);
+  while (in.read(block.data(), block.size()) || in.gcount() > 0) {
+    Add(block.data(), in.gcount());
+  }
+  return !in.bad();
+}
+
+void AlphaHistogram::Merge(const AlphaHistogram &other) {
+  for (size_t i = 0; i < char_range; ++i) {
+    histogram[i] += other.histogram[i];
+  }
+}
+
+void AlphaHistogram::Reset(void) {
+  std::fill(histogram.begin(), histogram.end(), 0);
 }
 
 unsigned long AlphaHistogram::count(unsigned char c) const {
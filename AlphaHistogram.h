@@ -10,28 +10,67 @@
 #ifndef ALPHAHISTOGRAM_H
 #define ALPHAHISTOGRAM_H
 
+#include <cstddef>
+#include <istream>
 #include <string>
 #include <vector>
 
 class AlphaHistogram {
 public:
   /**
-   * Constructor - read specified file and build histogram array
+   * Constructor - empty histogram, to be filled with Add
+   */
+  AlphaHistogram(void);
+  
+  /**
+   * Constructor - read specified file and build histogram array. The
+   *   file is scanned as raw bytes; a file that can be memory-mapped is
+   *   counted in parallel chunks.
    * 
-   * Throws exception on error.
+   * Exits with status 2 on error.
    * 
    * @param file_name name of file to histogram
+   * @param threads most threads to count with (0 for one per hardware thread)
    */
-  AlphaHistogram(const std::string &file_name);
+  AlphaHistogram(const std::string &file_name, unsigned threads = 0);
   ~AlphaHistogram() {}
   
-  // Rule of Five - disable other functionality (not strictly required
-  //  since the class would work fine with the defaults of all of these,
-  //  but required for this assignment)
+  // Rule of Five - movable, so results can be handed between threads; a
+  //  moved-from histogram is left empty. Copying is disabled (use Merge
+  //  into an empty histogram to duplicate one).
   AlphaHistogram(const AlphaHistogram &orig) = delete;
-  AlphaHistogram(AlphaHistogram &&orig) = delete;
-  AlphaHistogram operator=(const AlphaHistogram &orig) = delete;
-  AlphaHistogram operator=(AlphaHistogram &&orig) = delete;
+  AlphaHistogram(AlphaHistogram &&orig);
+  AlphaHistogram &operator=(const AlphaHistogram &orig) = delete;
+  AlphaHistogram &operator=(AlphaHistogram &&orig);
+  
+  /**
+   * Add - count the characters in a buffer
+   * 
+   * @param data first byte
+   * @param size number of bytes
+   */
+  void Add(const void *data, size_t size);
+  
+  /**
+   * Add - count the characters read from a stream, up to end of file
+   * 
+   * @param in stream to read (unformatted)
+   * @return false if a read error occurred (characters read before the
+   *   error are counted)
+   */
+  bool Add(std::istream &in);
+  
+  /**
+   * Merge - add the counts of another histogram to this one
+   * 
+   * @param other histogram to add
+   */
+  void Merge(const AlphaHistogram &other);
+  
+  /**
+   * Reset - set all counts to 0, for reuse
+   */
+  void Reset(void);
   
   /**
    * count - return number of occurrences of specified character
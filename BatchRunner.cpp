@@ -0,0 +1,169 @@
+/*
+ * BatchRunner implementation
+ */
+
+/* 
+ * File:   BatchRunner.cpp
+ */
+
+#include "BatchRunner.h"
+#include "ProcessTrace.h"
+#include "Scheduler.h"
+
+#include <MMU.h>
+
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <iomanip>
+#include <sstream>
+#include <thread>
+
+const uint32_t BatchRunner::kFrameCount;
+
+BatchRunner::BatchRunner(uint32_t workers_, PageFrameAllocator::Mode allocator_mode_,
+                         bool demand_paging_, uint32_t zero_pool_frames_,
+                         uint32_t time_slice_, uint32_t frame_count_)
+: workers(workers_), allocator_mode(allocator_mode_), demand_paging(demand_paging_),
+  zero_pool_frames(zero_pool_frames_), time_slice(time_slice_),
+  frame_count(frame_count_), stats(nullptr), failed(0),
+  seconds(0.0) {
+  if (workers == 0) {
+    workers = std::thread::hardware_concurrency();
+    if (workers == 0) {
+      workers = 1;
+    }
+  }
+}
+
+int BatchRunner::Run(std::ostream &out, std::ostream &err) {
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  
+  results.assign(files.size(), Result{ std::string(), std::string(), 0, false });
+  failed = 0;
+  
+  // Deal out consecutive blocks, so each worker's queue runs roughly in
+  // output order and thieves take work from the far end
+  uint32_t threads = static_cast<uint32_t>(
+          std::min<size_t>(workers, std::max<size_t>(files.size(), 1)));
+  queues.clear();
+  for (uint32_t w = 0; w < threads; ++w) {
+    queues.push_back(std::unique_ptr<WorkQueue>(new WorkQueue));
+    size_t begin = files.size() * w / threads;
+    size_t end = files.size() * (w + 1) / threads;
+    for (size_t i = begin; i < end; ++i) {
+      queues[w]->items.push_back(i);
+    }
+  }
+  
+  std::vector<std::thread> pool;
+  for (uint32_t w = 0; w < threads; ++w) {
+    pool.push_back(std::thread(&BatchRunner::Worker, this, w));
+  }
+  
+  // Write results in order as they complete
+  int exit_status = 0;
+  for (size_t i = 0; i < results.size(); ++i) {
+    Result result;
+    {
+      std::unique_lock<std::mutex> guard(results_lock);
+      result_ready.wait(guard, [this, i] { return results[i].done; });
+      std::swap(result, results[i]);
+    }
+    out << result.out;
+    out.flush();
+    err << result.err;
+    err.flush();
+    if (result.exit_status != 0) {
+      ++failed;
+      exit_status = std::max(exit_status, result.exit_status);
+    }
+  }
+  
+  for (std::thread &thread : pool) {
+    thread.join();
+  }
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  seconds = elapsed.count();
+  return exit_status;
+}
+
+void BatchRunner::Report(std::ostream &out) const {
+  double rate = seconds > 0 ? files.size() / seconds : 0;
+  out << "batch: " << std::dec << files.size() << " traces (" << failed
+      << " failed) on " << queues.size() << " workers in " << std::fixed
+      << std::setprecision(3) << seconds << " s (" << std::setprecision(1)
+      << rate << " traces/s)\n";
+}
+
+void BatchRunner::Worker(uint32_t worker) {
+  std::unique_ptr<CommandStats> worker_stats(stats ? new CommandStats : nullptr);
+  size_t index;
+  while (NextTrace(worker, index)) {
+    Result result{ std::string(), std::string(), 0, false };
+    RunTrace(files[index], result, worker_stats.get());
+    
+    std::lock_guard<std::mutex> guard(results_lock);
+    result.done = true;
+    std::swap(results[index], result);
+    result_ready.notify_all();
+  }
+
+  if (worker_stats) {
+    std::lock_guard<std::mutex> guard(results_lock);
+    stats->Merge(*worker_stats);
+  }
+}
+
+bool BatchRunner::NextTrace(uint32_t worker, size_t &index) {
+  // Own queue first, from the front
+  {
+    WorkQueue &own = *queues[worker];
+    std::lock_guard<std::mutex> guard(own.lock);
+    if (!own.items.empty()) {
+      index = own.items.front();
+      own.items.pop_front();
+      return true;
+    }
+  }
+  
+  // Steal from the back of the other queues
+  for (size_t i = 1; i < queues.size(); ++i) {
+    WorkQueue &victim = *queues[(worker + i) % queues.size()];
+    std::lock_guard<std::mutex> guard(victim.lock);
+    if (!victim.items.empty()) {
+      index = victim.items.back();
+      victim.items.pop_back();
+      return true;
+    }
+  }
+  return false;
+}
+
+void BatchRunner::RunTrace(const std::string &file_name, Result &result,
+                           CommandStats *trace_stats) {
+  std::ostringstream out;
+  std::ostringstream err;
+  {
+    mem::MMU memory(frame_count);
+    PageFrameAllocator allocator(memory, allocator_mode);
+    allocator.set_zero_pool_target(zero_pool_frames);
+    try {
+      Scheduler scheduler(time_slice);
+      std::unique_ptr<ProcessTrace> trace(
+              new ProcessTrace(file_name, memory, allocator, out, err));
+      trace->set_demand_paging(demand_paging);
+      trace->set_stats(trace_stats);
+      scheduler.Add(std::move(trace));
+      scheduler.Run();
+    } catch (TraceError &e) {
+      result.exit_status = e.get_exit_status();
+    } catch (std::exception &e) {
+      // Anything else would end the whole batch; report it against the trace
+      err << "ERROR: " << file_name << ": " << e.what() << "\n";
+      result.exit_status = 2;
+    }
+  }
+  result.out = out.str();
+  result.err = err.str();
+}
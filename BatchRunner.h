@@ -0,0 +1,160 @@
+/*
+ * BatchRunner - run many independent trace files in parallel
+ * 
+ * Each worker thread has its own MMU and page frame allocator, so traces
+ * don't share any simulated state and each runs exactly as it would alone.
+ * Trace files are dealt out to per-worker queues in blocks; a worker whose
+ * queue is empty steals from the back of another worker's queue. The
+ * output and error messages of each trace are captured separately and
+ * written in the order the traces were added, as soon as all earlier
+ * traces have finished.
+ */
+
+/* 
+ * File:   BatchRunner.h
+ */
+
+#ifndef BATCHRUNNER_H
+#define BATCHRUNNER_H
+
+#include "CommandStats.h"
+#include "PageFrameAllocator.h"
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+class BatchRunner {
+public:
+  /**
+   * Constructor
+   * 
+   * @param workers_ number of worker threads (0 for one per core)
+   * @param allocator_mode_ page frame allocator mode for every trace
+   * @param demand_paging_ run every trace with demand paging
+   * @param zero_pool_frames_ pre-zeroed pool size for every trace
+   * @param time_slice_ scheduler time slice for traces that fork
+   * @param frame_count_ number of simulated page frames for each trace
+   */
+  BatchRunner(uint32_t workers_, PageFrameAllocator::Mode allocator_mode_,
+              bool demand_paging_, uint32_t zero_pool_frames_,
+              uint32_t time_slice_, uint32_t frame_count_ = kFrameCount);
+  
+  virtual ~BatchRunner(void) {}
+  
+  // Disallow copy/move
+  BatchRunner(const BatchRunner &other) = delete;
+  BatchRunner(BatchRunner &&other) = delete;
+  BatchRunner &operator=(const BatchRunner &other) = delete;
+  BatchRunner &operator=(BatchRunner &&other) = delete;
+  
+  /**
+   * Add - add a trace file to the batch
+   */
+  void Add(const std::string &file_name) { files.push_back(file_name); }
+  
+  /**
+   * set_stats - collect command statistics for every trace into stats.
+   *   Each worker counts into its own CommandStats and merges it in when
+   *   the worker finishes.
+   * 
+   * @param stats_ statistics to add to (null to disable)
+   */
+  void set_stats(CommandStats *stats_) { stats = stats_; }
+  
+  /**
+   * Run - run all traces, writing each trace's output and error messages
+   *   in the order added
+   * 
+   * @param out stream receiving trace output
+   * @param err stream receiving error messages
+   * @return exit status: 0 if every trace succeeded, else the highest
+   *   status of a failed trace
+   */
+  int Run(std::ostream &out, std::ostream &err);
+  
+  /**
+   * Report - write traces run, failures, wall time and throughput of the
+   *   last Run
+   * 
+   * @param out stream to write report to
+   */
+  void Report(std::ostream &out) const;
+  
+  // Default number of simulated page frames for each trace
+  static const uint32_t kFrameCount = 0x100;
+  
+private:
+  // Captured results of one trace
+  struct Result {
+    std::string out;
+    std::string err;
+    int exit_status;
+    bool done;
+  };
+  
+  // Trace indices waiting to run on one worker
+  struct WorkQueue {
+    std::mutex lock;
+    std::deque<size_t> items;
+  };
+  
+  // Configuration
+  uint32_t workers;
+  PageFrameAllocator::Mode allocator_mode;
+  bool demand_paging;
+  uint32_t zero_pool_frames;
+  uint32_t time_slice;
+  uint32_t frame_count;
+  
+  // Command statistics for all traces (null if disabled; guarded by
+  // results_lock)
+  CommandStats *stats;
+  
+  // Trace files, and their results (guarded by results_lock)
+  std::vector<std::string> files;
+  std::vector<Result> results;
+  std::mutex results_lock;
+  std::condition_variable result_ready;
+  
+  // Per-worker queues
+  std::vector<std::unique_ptr<WorkQueue>> queues;
+  
+  // Summary of the last Run
+  uint32_t failed;
+  double seconds;
+  
+  /**
+   * Worker - thread body: run traces from own queue, then steal
+   * 
+   * @param worker index of this worker's queue
+   */
+  void Worker(uint32_t worker);
+  
+  /**
+   * NextTrace - take the next trace for a worker
+   * 
+   * @param worker index of the worker's queue
+   * @param index set to the trace index
+   * @return false if no traces remain in any queue
+   */
+  bool NextTrace(uint32_t worker, size_t &index);
+  
+  /**
+   * RunTrace - run one trace (and any processes it forks) on a fresh MMU
+   *   and allocator
+   * 
+   * @param file_name trace file
+   * @param result receives output, error messages and exit status
+   * @param trace_stats statistics to add to (null if disabled)
+   */
+  void RunTrace(const std::string &file_name, Result &result,
+                CommandStats *trace_stats);
+};
+
+#endif /* BATCHRUNNER_H */
@@ -0,0 +1,234 @@
+/*
+ * BinaryTrace implementation
+ */
+
+/* 
+ * File:   BinaryTrace.cpp
+ */
+
+#include "BinaryTrace.h"
+#include "TraceReader.h"
+
+#include <cstring>
+
+const char BinaryTrace::kMagic[8] = { 'P', 'T', 'R', 'A', 'C', 'E', 'B', 'N' };
+const uint32_t BinaryTrace::kVersion;
+const size_t BinaryTrace::kHeaderSize;
+
+namespace {
+
+const char *const kOpcodeNames[] = {
+  "alloc", "compare", "put", "fill", "copy", "dump", "writable", "#",
+  "free", "fork"
+};
+
+void PutLE32(std::vector<char> &out, uint32_t value) {
+  for (int i = 0; i < 4; ++i) {
+    out.push_back(static_cast<char>(value >> (8*i)));
+  }
+}
+
+void PutLE64(std::vector<char> &out, uint64_t value) {
+  PutLE32(out, static_cast<uint32_t>(value));
+  PutLE32(out, static_cast<uint32_t>(value >> 32));
+}
+
+uint64_t GetLE64(const uint8_t *p) {
+  uint64_t value = 0;
+  for (int i = 7; i >= 0; --i) {
+    value = (value << 8) | p[i];
+  }
+  return value;
+}
+
+}  // namespace
+
+BinaryTrace::BinaryTrace(const char *data_, size_t size_)
+: data(data_), size(size_), record_count(0), records_end(0),
+  position(kHeaderSize), line_number(0), is_valid(false), is_corrupt(false) {
+  if (IsBinary(data, size)) {
+    const uint8_t *header = reinterpret_cast<const uint8_t*>(data);
+    uint32_t version = GetLE32(header + 8);
+    record_count = GetLE32(header + 12);
+    records_end = GetLE64(header + 16);
+    is_valid = version == kVersion && records_end >= kHeaderSize
+            && records_end <= size;
+  }
+}
+
+bool BinaryTrace::IsBinary(const char *data, size_t size) {
+  return size >= kHeaderSize && memcmp(data, kMagic, sizeof(kMagic)) == 0;
+}
+
+bool BinaryTrace::Next(Record &record) {
+  if (!is_valid || position >= records_end) {
+    return false;
+  }
+  
+  // Fixed part of record: header word, count, and the optional addr and
+  // text length
+  const uint8_t *p = reinterpret_cast<const uint8_t*>(data + position);
+  size_t remaining = records_end - position;
+  if (remaining < 8) {
+    is_corrupt = true;
+    return false;
+  }
+  record.line_number = ++line_number;
+  record.opcode = static_cast<Opcode>(p[0]);
+  record.form = static_cast<Form>(p[1]);
+  uint8_t flags = p[2];
+  record.count = GetLE32(p + 4);
+  size_t fixed = 8;
+  record.addr = 0;
+  if (record.form == kBytes) {
+    if (remaining < fixed + 4) {
+      is_corrupt = true;
+      return false;
+    }
+    record.addr = GetLE32(p + fixed);
+    fixed += 4;
+  }
+  record.text_length = 0;
+  if (flags & kHasText) {
+    if (remaining < fixed + 4) {
+      is_corrupt = true;
+      return false;
+    }
+    record.text_length = GetLE32(p + fixed);
+    fixed += 4;
+  }
+  
+  // Variable part: text, then operands, padded to 4 bytes
+  uint64_t operand_bytes = record.form == kWords ? 4ULL*record.count : record.count;
+  uint64_t length = fixed + uint64_t(record.text_length) + operand_bytes;
+  length = (length + 3) & ~uint64_t(3);
+  if ((record.opcode >= kOpcodeCount && record.opcode != kUnknown)
+      || (record.opcode == kUnknown && !(flags & kHasText))
+      || record.form > kBytes || flags > kHasText || length > remaining) {
+    is_corrupt = true;
+    return false;
+  }
+  record.text = (flags & kHasText) ? reinterpret_cast<const char*>(p + fixed) : nullptr;
+  record.operands = p + fixed + record.text_length;
+  position += length;
+  return true;
+}
+
+BinaryTrace::Opcode BinaryTrace::LookupOpcode(const std::string &cmd) {
+  for (int op = kAlloc; op < kOpcodeCount; ++op) {
+    if (cmd == kOpcodeNames[op]) {
+      return static_cast<Opcode>(op);
+    }
+  }
+  return kUnknown;
+}
+
+const char *BinaryTrace::OpcodeName(Opcode opcode) {
+  return opcode < kOpcodeCount ? kOpcodeNames[opcode] : "";
+}
+
+std::string BinaryTrace::FormatCommand(Opcode opcode, const std::vector<uint32_t> &values) {
+  static const char kDigits[] = "0123456789abcdef";
+  std::string text(OpcodeName(opcode));
+  for (uint32_t value : values) {
+    char digits[8];
+    int n = 0;
+    do {
+      digits[n++] = kDigits[value & 0xF];
+      value >>= 4;
+    } while (value != 0);
+    text.push_back(' ');
+    while (n > 0) {
+      text.push_back(digits[--n]);
+    }
+  }
+  return text;
+}
+
+bool BinaryTrace::Compile(TraceReader &text, std::ostream &out, std::string &error) {
+  // Header, with record count and end of records filled in at the end
+  std::vector<char> buffer(kMagic, kMagic + sizeof(kMagic));
+  PutLE32(buffer, kVersion);
+  PutLE32(buffer, 0);
+  PutLE64(buffer, 0);
+  out.write(buffer.data(), buffer.size());
+  
+  std::vector<uint32_t> args;
+  uint64_t offset = kHeaderSize;
+  uint32_t line_number = 0;
+  const char *line;
+  size_t length;
+  while (text.NextLine(line, length)) {
+    ++line_number;
+    
+    // Command token and arguments, parsed the same way as ProcessTrace
+    const char *p = line;
+    const char *end = line + length;
+    while (p < end && TraceReader::IsSpace(*p)) ++p;
+    const char *cmd_start = p;
+    while (p < end && !TraceReader::IsSpace(*p)) ++p;
+    Opcode opcode = LookupOpcode(std::string(cmd_start, p - cmd_start));
+    args.clear();
+    if (opcode != kComment) {
+      TraceReader::ParseHex(p, end, args);
+    }
+    
+    // put/compare values go inline as bytes when they all fit
+    Form form = kWords;
+    if ((opcode == kPut || opcode == kCompare) && !args.empty()) {
+      form = kBytes;
+      for (size_t i = 1; i < args.size(); ++i) {
+        if (args[i] > 0xFF) form = kWords;
+      }
+    }
+    
+    // Line text only if replay can't rebuild it from the command
+    bool has_text = opcode == kUnknown
+            || FormatCommand(opcode, args) != std::string(line, length);
+    
+    buffer.clear();
+    buffer.push_back(static_cast<char>(opcode));
+    buffer.push_back(static_cast<char>(form));
+    buffer.push_back(static_cast<char>(has_text ? kHasText : 0));
+    buffer.push_back(0);
+    if (form == kBytes) {
+      PutLE32(buffer, static_cast<uint32_t>(args.size() - 1));
+      PutLE32(buffer, args[0]);
+    } else {
+      PutLE32(buffer, static_cast<uint32_t>(args.size()));
+    }
+    if (has_text) {
+      PutLE32(buffer, static_cast<uint32_t>(length));
+      buffer.insert(buffer.end(), line, line + length);
+    }
+    for (size_t i = (form == kBytes) ? 1 : 0; i < args.size(); ++i) {
+      if (form == kBytes) {
+        buffer.push_back(static_cast<char>(args[i]));
+      } else {
+        PutLE32(buffer, args[i]);
+      }
+    }
+    while (buffer.size() % 4 != 0) {
+      buffer.push_back(0);
+    }
+    out.write(buffer.data(), buffer.size());
+    offset += buffer.size();
+  }
+  if (text.fail()) {
+    error = "read failed at line " + std::to_string(line_number + 1);
+    return false;
+  }
+  
+  // Patch the header
+  buffer.clear();
+  PutLE32(buffer, line_number);
+  PutLE64(buffer, offset);
+  out.seekp(12);
+  out.write(buffer.data(), buffer.size());
+  out.flush();
+  if (!out) {
+    error = "write failed";
+    return false;
+  }
+  return true;
+}
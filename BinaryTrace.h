@@ -0,0 +1,165 @@
+/*
+ * BinaryTrace - compiled form of a trace file
+ * 
+ * A compiled trace holds the same commands as the text trace, already
+ * parsed, so replaying it needs no text parsing. There is one record per
+ * trace line, in order, so a record's line number is its position. The
+ * line text is stored only if it differs from the text FormatCommand
+ * gives for the record's command (comments, invalid commands, unusual
+ * spacing or number forms); either way echoed output and error messages
+ * match the text trace exactly. All integers are little-endian.
+ * 
+ * Layout:
+ *   header    - magic, version, record count, offset of end of records
+ *   records   - each padded to a multiple of 4 bytes:
+ *                 u8  opcode, u8 form, u8 flags, u8 reserved
+ *                 u32 count
+ *                 u32 addr                 (kBytes form only)
+ *                 u32 text_length          (kHasText flag only)
+ *                 text_length bytes        (original line text)
+ *                 operands                 (kWords: count u32 arguments,
+ *                                           kBytes: count byte values)
+ * 
+ * put and compare commands whose values all fit in a byte use the kBytes
+ * form, with the address in addr and the values inline as bytes.
+ */
+
+/* 
+ * File:   BinaryTrace.h
+ */
+
+#ifndef BINARYTRACE_H
+#define BINARYTRACE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+class TraceReader;
+
+class BinaryTrace {
+public:
+  // Trace commands. New commands are added before kOpcodeCount; kUnknown
+  // keeps its value so existing compiled traces stay readable.
+  enum Opcode {
+    kAlloc, kCompare, kPut, kFill, kCopy, kDump, kWritable, kComment,
+    kFree, kFork,
+    kOpcodeCount,
+    kUnknown = 0xFF  // invalid command, reported when replayed
+  };
+  
+  // Operand encodings
+  enum Form { kWords, kBytes };
+  
+  // Record flags
+  enum Flag { kHasText = 0x01 };
+  
+  // One decoded record; pointers refer into the compiled trace
+  struct Record {
+    uint32_t line_number;
+    const char *text;         // null if not stored (see FormatCommand)
+    uint32_t text_length;
+    Opcode opcode;
+    Form form;
+    uint32_t count;           // number of operands
+    uint32_t addr;            // address operand (kBytes form only)
+    const uint8_t *operands;  // count u32 words or count bytes
+  };
+  
+  /**
+   * Constructor - decode a compiled trace held in memory
+   * 
+   * @param data_ start of compiled trace (must stay valid)
+   * @param size_ size in bytes
+   */
+  BinaryTrace(const char *data_, size_t size_);
+  
+  // Disallow copy/move
+  BinaryTrace(const BinaryTrace &other) = delete;
+  BinaryTrace(BinaryTrace &&other) = delete;
+  BinaryTrace &operator=(const BinaryTrace &other) = delete;
+  BinaryTrace &operator=(BinaryTrace &&other) = delete;
+  
+  /**
+   * IsBinary - test whether data starts with the compiled trace magic
+   */
+  static bool IsBinary(const char *data, size_t size);
+  
+  /**
+   * valid - true if the header was recognized
+   */
+  bool valid(void) const { return is_valid; }
+  
+  /**
+   * Next - decode the next record
+   * 
+   * @param record returns decoded record
+   * @return true if record returned, false at end of trace or if the
+   *   record is truncated (see fail)
+   */
+  bool Next(Record &record);
+  
+  /**
+   * fail - true if a truncated or corrupt record was found
+   */
+  bool fail(void) const { return is_corrupt; }
+  
+  /**
+   * Word - decode argument i of a kWords record
+   */
+  static uint32_t Word(const uint8_t *operands, uint32_t i) {
+    return GetLE32(operands + 4*i);
+  }
+  
+  /**
+   * LookupOpcode, OpcodeName - convert between command names and opcodes
+   */
+  static Opcode LookupOpcode(const std::string &cmd);
+  static const char *OpcodeName(Opcode opcode);
+  
+  /**
+   * FormatCommand - line text of a command in the usual form: the command
+   *   name and each value in lower-case hex, separated by single spaces
+   * 
+   * @param opcode command (not kUnknown)
+   * @param values all numeric arguments, in order
+   */
+  static std::string FormatCommand(Opcode opcode, const std::vector<uint32_t> &values);
+  
+  /**
+   * Compile - convert a text trace to the compiled form
+   * 
+   * @param text source of trace lines
+   * @param out destination of compiled trace (must be seekable)
+   * @param error returns description of failure
+   * @return true if success
+   */
+  static bool Compile(TraceReader &text, std::ostream &out, std::string &error);
+  
+  // Header layout
+  static const char kMagic[8];
+  static const uint32_t kVersion = 3;
+  static const size_t kHeaderSize = 24;
+  
+private:
+  // Compiled trace contents
+  const char *data;
+  size_t size;
+  
+  // Header fields, and offset and line number of next record to decode
+  uint32_t record_count;
+  uint64_t records_end;
+  size_t position;
+  uint32_t line_number;
+  
+  bool is_valid;
+  bool is_corrupt;
+  
+  static uint32_t GetLE32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+  }
+};
+
+#endif /* BINARYTRACE_H */
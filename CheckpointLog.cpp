@@ -0,0 +1,78 @@
+/*
+ * CheckpointLog implementation
+ */
+
+/*
+ * File:   CheckpointLog.cpp
+ */
+
+#include "CheckpointLog.h"
+
+#include <vector>
+
+CheckpointLog::CheckpointLog(const std::string &file_name, mem::MMU &memory,
+                             PageFrameAllocator &allocator_)
+: out(file_name, memory.get_frame_count(), allocator_.get_mode(), true),
+  allocator(&allocator_), count(0) {
+  allocator->EnableDirtyLog();
+}
+
+void CheckpointLog::Add(uint64_t commands, Scheduler &scheduler) {
+  // Pages written since the last checkpoint join the dirty log first
+  scheduler.LogModifiedPages();
+
+  uint64_t start = out.Tell();
+  out.Put64(commands);
+  out.Put64(scheduler.get_line_number());
+  out.Put64(0);  // scheduler section and end, filled in below
+  out.Put64(0);
+  allocator->Save(out, count > 0);
+  uint64_t scheduler_offset = out.Tell();
+  scheduler.Save(out);
+  out.Put64At(start + 16, scheduler_offset);
+  out.Put64At(start + 24, out.Tell());
+  ++count;
+}
+
+bool CheckpointLog::Restore(SnapshotReader &in, long line_number, mem::MMU &memory,
+                            PageFrameAllocator &allocator, Scheduler &scheduler,
+                            const Scheduler::ProcessSetup &setup, uint64_t &commands) {
+  // Find the checkpoints, and the last one before line_number
+  struct Checkpoint {
+    uint64_t commands;
+    uint64_t allocator_offset;
+    uint64_t scheduler_offset;
+  };
+  std::vector<Checkpoint> checkpoints;
+  size_t chosen = 0;
+  while (!in.at_end() && !in.fail()) {
+    Checkpoint checkpoint;
+    checkpoint.commands = in.Get64();
+    uint64_t line = in.Get64();
+    checkpoint.scheduler_offset = in.Get64();
+    uint64_t end = in.Get64();
+    checkpoint.allocator_offset = in.get_position();
+    if (checkpoint.scheduler_offset < checkpoint.allocator_offset
+        || end < checkpoint.scheduler_offset) {
+      return false;
+    }
+    if (checkpoints.empty() || line < static_cast<uint64_t>(line_number)) {
+      chosen = checkpoints.size();
+    }
+    checkpoints.push_back(checkpoint);
+    in.Seek(end);
+  }
+  if (in.fail() || checkpoints.empty()) {
+    return false;
+  }
+
+  // Frames of every checkpoint up to the chosen one, then its processes
+  for (size_t i = 0; i <= chosen; ++i) {
+    in.Seek(checkpoints[i].allocator_offset);
+    if (!allocator.Load(in) || in.get_position() != checkpoints[i].scheduler_offset) {
+      return false;
+    }
+  }
+  commands = checkpoints[chosen].commands;
+  return scheduler.Load(in, memory, allocator, setup);
+}
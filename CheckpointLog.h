@@ -0,0 +1,109 @@
+/*
+ * CheckpointLog - periodic, incremental checkpoints of a run, to seek to
+ *   a trace line without replaying the whole trace
+ *
+ * The first checkpoint is a full snapshot of the machine (see Snapshot.h).
+ * Each later one saves only the frames changed since the one before it:
+ * pages written through the MMU, found from their Modified bits (see
+ * ProcessTrace::LogModifiedPages), and frames written through physical
+ * addresses (page tables, cleared and copied frames), found from the
+ * allocator's dirty log. The allocator's free-frame state and the
+ * scheduler's processes, with their trace positions, are saved in full
+ * each time; they are small next to the frames.
+ *
+ * Restoring a checkpoint loads the frames of every checkpoint up to it, in
+ * order, then its allocator state and processes.
+ *
+ * Layout (after the snapshot header, with the checkpoint log magic), for
+ * each checkpoint:
+ *   u64 commands run before it, u64 highest line number executed,
+ *   u64 offset of its scheduler section, u64 offset of the next checkpoint
+ *   allocator section  - PageFrameAllocator::Save (changed frames only
+ *                        after the first)
+ *   scheduler section  - Scheduler::Save
+ */
+
+/*
+ * File:   CheckpointLog.h
+ */
+
+#ifndef CHECKPOINTLOG_H
+#define CHECKPOINTLOG_H
+
+#include "PageFrameAllocator.h"
+#include "Scheduler.h"
+#include "Snapshot.h"
+
+#include <MMU.h>
+
+#include <cstdint>
+#include <string>
+
+class CheckpointLog {
+public:
+  /**
+   * Constructor - create a checkpoint log and start the allocator's dirty
+   *   log (see PageFrameAllocator::EnableDirtyLog)
+   *
+   * @param file_name log file to create
+   * @param memory MMU being checkpointed
+   * @param allocator_ allocator of its frames
+   */
+  CheckpointLog(const std::string &file_name, mem::MMU &memory,
+                PageFrameAllocator &allocator_);
+
+  virtual ~CheckpointLog(void) {}
+
+  // Disallow copy/move
+  CheckpointLog(const CheckpointLog &other) = delete;
+  CheckpointLog(CheckpointLog &&other) = delete;
+  CheckpointLog &operator=(const CheckpointLog &other) = delete;
+  CheckpointLog &operator=(CheckpointLog &&other) = delete;
+
+  /**
+   * Add - write a checkpoint of the machine. Call between Scheduler::Run
+   *   calls.
+   *
+   * @param commands commands run so far
+   * @param scheduler scheduler running the processes
+   */
+  void Add(uint64_t commands, Scheduler &scheduler);
+
+  /**
+   * Close - finish writing the log
+   *
+   * @return true if every write succeeded
+   */
+  bool Close(void) { return out.Close(); }
+
+  // Access to private values
+  uint32_t get_count(void) const { return count; }
+
+  /**
+   * Restore - load the last checkpoint taken before any process executed
+   *   trace line line_number (the first checkpoint if there is none)
+   *
+   * @param in checkpoint log being read (see SnapshotReader::is_log)
+   * @param line_number line to seek to
+   * @param memory, allocator machine with the frame count and allocator
+   *   mode of the log header
+   * @param scheduler empty scheduler to add the processes to
+   * @param setup called with each restored process (see Scheduler::Load)
+   * @param commands returns commands run before the checkpoint
+   * @return true if success, false if the log is corrupt or doesn't match
+   *   the trace files
+   * @throws TraceError if a trace file can't be opened
+   */
+  static bool Restore(SnapshotReader &in, long line_number, mem::MMU &memory,
+                      PageFrameAllocator &allocator, Scheduler &scheduler,
+                      const Scheduler::ProcessSetup &setup, uint64_t &commands);
+
+private:
+  SnapshotWriter out;
+  PageFrameAllocator *allocator;
+
+  // Checkpoints written
+  uint32_t count;
+};
+
+#endif /* CHECKPOINTLOG_H */
@@ -0,0 +1,122 @@
+/*
+ * CommandStats implementation
+ */
+
+/*
+ * File:   CommandStats.cpp
+ */
+
+#include "CommandStats.h"
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
+const uint32_t CommandStats::kBuckets;
+const size_t CommandStats::kFusedCompare;
+
+CommandStats::CommandStats(void) {
+  memset(&counters, 0, sizeof(counters));
+  for (Latency &command : latency) {
+    command.count = 0;
+    command.total_ns = 0;
+    command.min_ns = std::numeric_limits<uint64_t>::max();
+    command.max_ns = 0;
+    command.bytes = 0;
+    command.buckets.fill(0);
+  }
+}
+
+void CommandStats::RecordCommand(BinaryTrace::Opcode opcode, uint64_t nanoseconds,
+                                 uint64_t bytes, bool fused) {
+  if (opcode >= BinaryTrace::kOpcodeCount) {
+    return;
+  }
+  Latency &command = latency[Index(opcode, fused)];
+  ++command.count;
+  command.total_ns += nanoseconds;
+  command.min_ns = std::min(command.min_ns, nanoseconds);
+  command.max_ns = std::max(command.max_ns, nanoseconds);
+  command.bytes += bytes;
+
+  // Bucket is floor(log2(ns)), with 0 ns in the first
+  uint32_t bucket = 0;
+  while (bucket + 1 < kBuckets && (nanoseconds >> (bucket + 1)) != 0) {
+    ++bucket;
+  }
+  ++command.buckets[bucket];
+}
+
+void CommandStats::Merge(const CommandStats &other) {
+  const uint64_t *from = reinterpret_cast<const uint64_t*> (&other.counters);
+  uint64_t *to = reinterpret_cast<uint64_t*> (&counters);
+  for (size_t i = 0; i < sizeof(Counters) / sizeof(uint64_t); ++i) {
+    to[i] += from[i];
+  }
+  for (size_t op = 0; op < latency.size(); ++op) {
+    Latency &command = latency[op];
+    const Latency &other_command = other.latency[op];
+    command.count += other_command.count;
+    command.total_ns += other_command.total_ns;
+    command.min_ns = std::min(command.min_ns, other_command.min_ns);
+    command.max_ns = std::max(command.max_ns, other_command.max_ns);
+    command.bytes += other_command.bytes;
+    for (uint32_t i = 0; i < kBuckets; ++i) {
+      command.buckets[i] += other_command.buckets[i];
+    }
+  }
+}
+
+void CommandStats::WriteJson(std::ostream &out) const {
+  out << std::dec << "{\n  \"commands\": {";
+  bool first = true;
+  for (size_t op = 0; op < latency.size(); ++op) {
+    const Latency &command = latency[op];
+    if (command.count == 0) {
+      continue;
+    }
+    BinaryTrace::Opcode opcode = static_cast<BinaryTrace::Opcode>(op);
+    out << (first ? "\n" : ",\n") << "    \""
+        << (op == kFusedCompare ? "compare_fused"
+            : opcode == BinaryTrace::kComment ? "comment" : BinaryTrace::OpcodeName(opcode))
+        << "\": {\"count\": " << command.count
+        << ", \"total_ns\": " << command.total_ns
+        << ", \"min_ns\": " << command.min_ns
+        << ", \"max_ns\": " << command.max_ns
+        << ", \"bytes\": " << command.bytes
+        << ", \"histogram\": [";
+
+    // Non-empty buckets only, each labelled by its upper bound
+    bool first_bucket = true;
+    for (uint32_t i = 0; i < kBuckets; ++i) {
+      if (command.buckets[i] == 0) {
+        continue;
+      }
+      out << (first_bucket ? "" : ", ") << "{\"below_ns\": ";
+      if (i + 1 < kBuckets) {
+        out << (uint64_t(1) << (i + 1));
+      } else {
+        out << "null";
+      }
+      out << ", \"count\": " << command.buckets[i] << "}";
+      first_bucket = false;
+    }
+    out << "]}";
+    first = false;
+  }
+  out << "\n  },\n  \"counters\": {"
+      << "\n    \"mmu_calls\": " << counters.mmu_calls
+      << ",\n    \"bytes_read\": " << counters.bytes_read
+      << ",\n    \"bytes_written\": " << counters.bytes_written
+      << ",\n    \"page_table_bytes_read\": " << counters.page_table_bytes_read
+      << ",\n    \"page_table_bytes_written\": " << counters.page_table_bytes_written
+      << ",\n    \"frames_allocated\": " << counters.frames_allocated
+      << ",\n    \"frames_freed\": " << counters.frames_freed
+      << ",\n    \"page_faults\": " << counters.page_faults
+      << ",\n    \"write_faults\": " << counters.write_faults
+      << ",\n    \"faults_reported\": " << counters.faults_reported
+      << ",\n    \"demand_maps\": " << counters.demand_maps
+      << ",\n    \"swap_ins\": " << counters.swap_ins
+      << ",\n    \"cow_breaks\": " << counters.cow_breaks
+      << "\n  }\n}\n";
+}
@@ -0,0 +1,127 @@
+/*
+ * CommandStats - per-command latency and memory-traffic counters
+ *
+ * Collected by ProcessTrace when enabled (see ProcessTrace::set_stats);
+ * a process with no CommandStats does no timing or counting beyond one
+ * null test per site. Each command's wall-clock latency goes into a
+ * histogram for its command type, with power-of-two nanosecond buckets.
+ * The counters cover the MMU traffic of trace commands and page-table
+ * maintenance, frames taken and returned, and faults raised by the MMU.
+ * The report is written as JSON.
+ *
+ * Compares skipped as fused with the put before them (see TraceProgram.h)
+ * have a histogram of their own, so compare latency covers only compares
+ * that did the work.
+ *
+ * A CommandStats is not thread safe; threads keep their own and Merge
+ * them when done.
+ */
+
+/*
+ * File:   CommandStats.h
+ */
+
+#ifndef COMMANDSTATS_H
+#define COMMANDSTATS_H
+
+#include "BinaryTrace.h"
+
+#include <array>
+#include <cstdint>
+#include <ostream>
+
+class CommandStats {
+public:
+  /**
+   * Event counters; ProcessTrace increments them directly
+   */
+  struct Counters {
+    uint64_t mmu_calls;                // get_bytes/put_bytes calls made
+    uint64_t bytes_read;               // trace data read through the MMU
+    uint64_t bytes_written;            // trace data written through the MMU
+    uint64_t page_table_bytes_read;    // page-table entries read
+    uint64_t page_table_bytes_written; // page-table entries written
+    uint64_t frames_allocated;         // for pages and page tables
+    uint64_t frames_freed;             // returned to the allocator (not evicted)
+    uint64_t page_faults;              // raised by the MMU, resolved or not
+    uint64_t write_faults;             // raised by the MMU, resolved or not
+    uint64_t faults_reported;          // written to the trace output
+    uint64_t demand_maps;              // page faults resolved by demand paging
+    uint64_t swap_ins;                 // page faults resolved from swap
+    uint64_t cow_breaks;               // write faults resolved by copy-on-write
+  };
+
+  CommandStats(void);
+
+  virtual ~CommandStats(void) {}
+
+  // Disallow copy/move
+  CommandStats(const CommandStats &other) = delete;
+  CommandStats(CommandStats &&other) = delete;
+  CommandStats &operator=(const CommandStats &other) = delete;
+  CommandStats &operator=(CommandStats &&other) = delete;
+
+  /**
+   * RecordCommand - add one executed command to its latency histogram
+   *
+   * @param opcode command type (kUnknown for invalid commands, not recorded)
+   * @param nanoseconds time taken by the command
+   * @param bytes trace data the command read and wrote through the MMU
+   * @param fused true for a compare skipped as fused with its put
+   */
+  void RecordCommand(BinaryTrace::Opcode opcode, uint64_t nanoseconds,
+                     uint64_t bytes, bool fused = false);
+
+  /**
+   * Merge - add another set of statistics to this one
+   */
+  void Merge(const CommandStats &other);
+
+  /**
+   * WriteJson - write the report
+   *
+   * @param out stream to write to
+   */
+  void WriteJson(std::ostream &out) const;
+
+  /**
+   * get_count, get_total_ns, get_bytes - totals for one command type
+   *   (fused: for compares skipped as fused)
+   */
+  uint64_t get_count(BinaryTrace::Opcode opcode, bool fused = false) const {
+    return latency[Index(opcode, fused)].count;
+  }
+  uint64_t get_total_ns(BinaryTrace::Opcode opcode, bool fused = false) const {
+    return latency[Index(opcode, fused)].total_ns;
+  }
+  uint64_t get_bytes(BinaryTrace::Opcode opcode, bool fused = false) const {
+    return latency[Index(opcode, fused)].bytes;
+  }
+
+  Counters counters;
+
+  // Number of histogram buckets; bucket i counts latencies below 2^(i+1)
+  // ns, and the last one everything longer
+  static const uint32_t kBuckets = 32;
+
+private:
+  // Latency of one command type
+  struct Latency {
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t min_ns;
+    uint64_t max_ns;
+    uint64_t bytes;
+    std::array<uint64_t, kBuckets> buckets;
+  };
+
+  // Latency of each command type, then of fused compares
+  static const size_t kFusedCompare = BinaryTrace::kOpcodeCount;
+  std::array<Latency, BinaryTrace::kOpcodeCount + 1> latency;
+
+  static size_t Index(BinaryTrace::Opcode opcode, bool fused) {
+    return fused ? kFusedCompare : static_cast<size_t>(opcode);
+  }
+};
+
+#endif /* COMMANDSTATS_H */
@@ -0,0 +1,86 @@
+/*
+ * OutputSink implementation
+ */
+
+/* 
+ * File:   OutputSink.cpp
+ */
+
+#include "OutputSink.h"
+
+#include <cstring>
+
+namespace {
+
+const char kHexDigits[] = "0123456789abcdef";
+
+// " xx" text of every byte value, for dump rows
+struct HexByteTable {
+  char text[256][3];
+  HexByteTable() {
+    for (int value = 0; value < 256; ++value) {
+      text[value][0] = ' ';
+      text[value][1] = kHexDigits[value >> 4];
+      text[value][2] = kHexDigits[value & 0xF];
+    }
+  }
+};
+const HexByteTable kHexBytes;
+
+}  // namespace
+
+const size_t OutputSink::kDefaultThreshold;
+
+OutputSink::OutputSink(std::ostream &out_, size_t flush_threshold_)
+: out(&out_), flush_threshold(flush_threshold_) {
+  buffer.reserve(flush_threshold + 256);
+}
+
+void OutputSink::Append(const char *text) {
+  Append(text, strlen(text));
+}
+
+void OutputSink::AppendDecimal(unsigned long value) {
+  char digits[24];
+  char *p = digits + sizeof(digits);
+  do {
+    *--p = '0' + value % 10;
+    value /= 10;
+  } while (value != 0);
+  Append(p, digits + sizeof(digits) - p);
+}
+
+void OutputSink::AppendHex(uint32_t value) {
+  char digits[8];
+  char *p = digits + sizeof(digits);
+  do {
+    *--p = kHexDigits[value & 0xF];
+    value >>= 4;
+  } while (value != 0);
+  Append(p, digits + sizeof(digits) - p);
+}
+
+void OutputSink::AppendHexBytes(const uint8_t *bytes, size_t count) {
+  if (count == 0) {
+    return;
+  }
+  size_t start = buffer.size();
+  buffer.resize(start + 3*count);
+  char *p = &buffer[start];
+  for (size_t i = 0; i < count; ++i, p += 3) {
+    memcpy(p, kHexBytes.text[bytes[i]], 3);
+  }
+  CheckThreshold();
+}
+
+void OutputSink::Flush(void) {
+  Write();
+  out->flush();
+}
+
+void OutputSink::Write(void) {
+  if (!buffer.empty()) {
+    out->write(buffer.data(), buffer.size());
+    buffer.clear();
+  }
+}
@@ -0,0 +1,114 @@
+/*
+ * OutputSink - buffered text output for trace processing
+ * 
+ * Output is collected in a reusable buffer and written to the underlying
+ * stream in large pieces: when the buffer passes a size threshold, and when
+ * Flush is called. Numbers are formatted from lookup tables with the same
+ * text the iostream manipulators would produce.
+ */
+
+/* 
+ * File:   OutputSink.h
+ */
+
+#ifndef OUTPUTSINK_H
+#define OUTPUTSINK_H
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+class OutputSink {
+public:
+  /**
+   * Constructor
+   * 
+   * @param out_ stream receiving the output
+   * @param flush_threshold_ buffered size at which output is written out
+   */
+  OutputSink(std::ostream &out_, size_t flush_threshold_ = kDefaultThreshold);
+  
+  /**
+   * Destructor - flush remaining output
+   */
+  virtual ~OutputSink(void) { Flush(); }
+  
+  // Disallow copy/move
+  OutputSink(const OutputSink &other) = delete;
+  OutputSink(OutputSink &&other) = delete;
+  OutputSink &operator=(const OutputSink &other) = delete;
+  OutputSink &operator=(OutputSink &&other) = delete;
+  
+  /**
+   * Append - add text to output
+   */
+  void Append(const char *text, size_t length) {
+    buffer.insert(buffer.end(), text, text + length);
+    CheckThreshold();
+  }
+  void Append(const std::string &text) { Append(text.data(), text.size()); }
+  void Append(const char *text);
+  void Append(char c) {
+    buffer.push_back(c);
+    CheckThreshold();
+  }
+  
+  /**
+   * get_stream - stream receiving the output
+   */
+  std::ostream &get_stream(void) const { return *out; }
+  
+  /**
+   * AppendDecimal - add unsigned number in decimal (like std::dec)
+   */
+  void AppendDecimal(unsigned long value);
+  
+  /**
+   * AppendHex - add number in lower case hex with no leading zeros
+   *   (like std::hex)
+   */
+  void AppendHex(uint32_t value);
+  
+  /**
+   * AppendHexBytes - add each byte as a blank followed by exactly 2 lower
+   *   case hex digits (the dump format)
+   * 
+   * @param bytes values to add
+   * @param count number of values
+   */
+  void AppendHexBytes(const uint8_t *bytes, size_t count);
+  
+  /**
+   * Flush - write all buffered output and flush the stream
+   */
+  void Flush(void);
+  
+  // Default threshold for writing buffered output
+  static const size_t kDefaultThreshold = 1 << 16;
+  
+private:
+  // Destination stream
+  std::ostream *out;
+  
+  // Buffered output, and size that triggers a write
+  std::vector<char> buffer;
+  size_t flush_threshold;
+  
+  /**
+   * CheckThreshold - write buffered output once it is large enough
+   */
+  void CheckThreshold(void) {
+    if (buffer.size() >= flush_threshold) {
+      Write();
+    }
+  }
+  
+  /**
+   * Write - pass buffered output to the stream (without flushing it)
+   */
+  void Write(void);
+};
+
+#endif /* OUTPUTSINK_H */
@@ -7,48 +7,93 @@
  */
 
 #include "PageFrameAllocator.h"
+#include "Snapshot.h"
 
-#include <cstring>
+#include <algorithm>
+#include <map>
 #include <sstream>
 
-PageFrameAllocator::PageFrameAllocator(MMU &mmu_mem) {
+const uint32_t PageFrameAllocator::kClearChunkFrames;
+
+namespace {
+
+// Frames moved per MMU call when saving or loading a snapshot
+const uint32_t kSnapshotChunkFrames = 64;
+
+void PutFrames(SnapshotWriter &out, const std::vector<uint32_t> &frames) {
+  out.Put32(frames.size());
+  for (uint32_t frame : frames) {
+    out.Put32(frame);
+  }
+}
+
+/*
+ * GetFrames - read a list written by PutFrames
+ * 
+ * @return false if the list is truncated or has a frame number >= total
+ */
+bool GetFrames(SnapshotReader &in, uint32_t total, std::vector<uint32_t> &frames) {
+  uint32_t count = in.Get32();
+  if (count > total) {
+    return false;
+  }
+  frames.resize(count);
+  for (uint32_t &frame : frames) {
+    frame = in.Get32();
+    if (frame >= total) {
+      return false;
+    }
+  }
+  return !in.fail();
+}
+
+}  // namespace
+
+PageFrameAllocator::PageFrameAllocator(MMU &mmu_mem, Mode mode_)
+: shared_frames(0), zero_pool_target(0), mode(mode_), buddy_max_order(0) {
     //Set our internal MMU pointer to the pointer provided in our constructor
     mem = &mmu_mem;
 
-    //Build our free list
+    /* No frame is touched here: the free list starts empty, and frames
+     * never handed out are taken in ascending order from next_untouched,
+     * the same order a list linking every frame would give */
     page_frames_total = mem->get_frame_count();
     page_frames_free = mem->get_frame_count();
-    free_list_head = 0;
+    free_list_head = kEndList;
+    next_untouched = 0;
 
-    //Add all page frames to free list
-    /* This code puts a value of 0, 1, 2, ... into the first 4 bytes of 
-     * each page frame. */
-    for (Addr frame = 0; frame < page_frames_total-1; ++frame) {
-        Addr next = frame + 1;
-        mem->put_bytes(frame*kPageSize, sizeof(Addr), reinterpret_cast<uint8_t*>(&next));
+    if (mode == kBuddy) {
+        /* Buddy bookkeeping is kept on the host. Carve all frames into the
+         * largest aligned blocks that fit (frame count need not be a power
+         * of 2); there are at most two per order. */
+        next_untouched = page_frames_total;
+        while ((1ULL << (buddy_max_order + 1)) <= page_frames_total) {
+            ++buddy_max_order;
+        }
+        buddy_free.resize(buddy_max_order + 1);
+        BuddyFreeRange(0, page_frames_total);
     }
-    
-    /* This code sets the first four bytes of the very last page frame
-     * equal to 0xFFFFFFFF, which is our end-of-list marker */
-    Addr end_list = kEndList;
-    mem->put_bytes((page_frames_total-1)*kPageSize, sizeof(Addr), reinterpret_cast<uint8_t*>(&end_list));
-
 }
 
-bool PageFrameAllocator::Allocate(uint32_t count) {
+bool PageFrameAllocator::Allocate(uint32_t count,
+                                  std::vector<uint32_t> &page_frames) {
     if (count <= page_frames_free) { // if enough to allocate
-        Addr freeListHead_offset = free_list_head*kPageSize;
+        page_frames.reserve(page_frames.size() + count);
+        page_frames_free -= count;
+        
+        /* Hand out pre-zeroed frames first */
+        while (count > 0 && !zero_pool.empty()) {
+            page_frames.push_back(zero_pool.back());
+            zero_pool.pop_back();
+            --count;
+        }
         
-        uint32_t zero = 0;
+        /* Pool exhausted: clear the remaining frames inline */
         while (count-- > 0) {
-            /* Clear page frame before handing it off */
-            mem->get_bytes(reinterpret_cast<uint8_t*>(&free_list_head), freeListHead_offset, sizeof(Addr));
-            for(Addr i = 0; i < kPageSize; i+=sizeof(uint32_t)){
-                mem->put_bytes(freeListHead_offset, sizeof(uint32_t), reinterpret_cast<uint8_t*>(&zero));  
-            }
-            //free_list_head++;
-            freeListHead_offset = free_list_head*kPageSize;
-            --page_frames_free;
+            uint32_t frame;
+            TakeFreeFrame(frame);  // can't fail, frames are free
+            ZeroFrame(frame);
+            page_frames.push_back(frame);
         }
         return true;
     } else {
@@ -56,16 +101,95 @@ bool PageFrameAllocator::Allocate(uint32_t count) {
     }
 }
 
+bool PageFrameAllocator::AllocateContiguous(uint32_t count,
+                                            std::vector<uint32_t> &page_frames) {
+    if (mode != kBuddy || count == 0 || count > page_frames_free) {
+        return false;
+    }
+    
+    // Smallest block holding count frames
+    uint32_t order = 0;
+    while ((1ULL << order) < count) {
+        ++order;
+    }
+    uint32_t first;
+    if (order > buddy_max_order) {
+        return false;
+    }
+    if (!BuddyAllocBlock(order, first)) {
+        /* Pooled frames may be splitting the run we need; give them back to
+         * the buddy lists so they can coalesce, then try once more */
+        if (zero_pool.empty()) {
+            return false;
+        }
+        for (uint32_t frame : zero_pool) {
+            BuddyFreeBlock(frame, 0);
+        }
+        zero_pool.clear();
+        if (!BuddyAllocBlock(order, first)) {
+            return false;
+        }
+    }
+    
+    // Give back the unused tail of the block
+    BuddyFreeRange(first + count, first + (1U << order));
+    page_frames_free -= count;
+    
+    /* Clear the run a chunk at a time from one shared buffer of zeros;
+     * a whole run's byte count may not fit in 32 bits */
+    static const std::vector<uint8_t> zero_chunk(kClearChunkFrames * kPageSize, 0);
+    for (uint32_t done = 0; done < count; done += kClearChunkFrames) {
+        uint32_t chunk = std::min(count - done, kClearChunkFrames);
+        mem->put_bytes((first + done)*kPageSize, chunk*kPageSize,
+                       const_cast<uint8_t*>(zero_chunk.data()));
+    }
+    for (uint32_t frame = first; frame < first + count; ++frame) {
+        MarkDirty(frame);
+    }
+    
+    page_frames.reserve(page_frames.size() + count);
+    for (uint32_t frame = first; frame < first + count; ++frame) {
+        page_frames.push_back(frame);
+    }
+    return true;
+}
+
+uint32_t PageFrameAllocator::Scrub(uint32_t max_frames) {
+    if (zero_pool.size() >= zero_pool_target) {
+        return 0;  // pool already full
+    }
+    
+    /* Frames are cleared through physical addresses, so switch modes for
+     * the duration and restore whatever the caller was running with */
+    PMCB saved_pmcb;
+    mem->get_PMCB(saved_pmcb);
+    mem->set_PMCB(PMCB());
+    
+    uint32_t scrubbed = 0;
+    uint32_t frame;
+    while (scrubbed < max_frames && zero_pool.size() < zero_pool_target
+           && zero_pool.size() < page_frames_free && TakeFreeFrame(frame)) {
+        ZeroFrame(frame);
+        zero_pool.push_back(frame);
+        ++scrubbed;
+    }
+    
+    mem->set_PMCB(saved_pmcb);
+    return scrubbed;
+}
+
 bool PageFrameAllocator::Deallocate(uint32_t count,
                                     std::vector<uint32_t> &page_frames) {
   // If enough to deallocate
   if(count <= page_frames.size()) {
     while(count-- > 0) {
-      // Return next frame to head of free list
+      // Return next frame to head of free list, unless still shared
       uint32_t frame = page_frames.back();
       page_frames.pop_back();
-      memcpy(&memory[frame * kPageSize], &free_list_head, sizeof(uint32_t));
-      free_list_head = frame;
+      if (shared_frames > 0 && DropReference(frame)) {
+        continue;
+      }
+      ReturnFreeFrame(frame);
       ++page_frames_free;
     }
     return true;
@@ -74,15 +198,272 @@ bool PageFrameAllocator::Deallocate(uint32_t count,
   }
 }
 
+void PageFrameAllocator::AddReference(uint32_t frame) {
+  if (extra_references[frame]++ == 0) {
+    ++shared_frames;
+  }
+}
+
+bool PageFrameAllocator::IsShared(uint32_t frame) {
+  if (shared_frames == 0) {
+    return false;
+  }
+  return extra_references.count(frame) != 0;
+}
+
+bool PageFrameAllocator::DropReference(uint32_t frame) {
+  std::unordered_map<uint32_t, uint32_t>::iterator entry = extra_references.find(frame);
+  if (entry == extra_references.end()) {
+    return false;
+  }
+  if (--entry->second == 0) {
+    extra_references.erase(entry);
+    --shared_frames;
+  }
+  return true;
+}
+
+void PageFrameAllocator::ReturnFreeFrame(uint32_t frame) {
+  if (mode == kBuddy) {
+    BuddyFreeBlock(frame, 0);
+  } else {
+    mem->put_bytes(frame*kPageSize, sizeof(Addr), reinterpret_cast<uint8_t*>(&free_list_head));
+    free_list_head = frame;
+  }
+}
+
 std::string PageFrameAllocator::FreeListToString(void) const {
   std::ostringstream out_string;
   
+  if (mode == kBuddy) {
+    // Every free frame, in ascending order
+    std::map<uint32_t, uint32_t> blocks;
+    for (uint32_t order = 0; order <= buddy_max_order; ++order) {
+      for (uint32_t first : buddy_free[order]) {
+        blocks[first] = first + (1U << order);
+      }
+    }
+    for (const std::pair<const uint32_t, uint32_t> &block : blocks) {
+      for (uint32_t frame = block.first; frame < block.second; ++frame) {
+        out_string << " " << std::hex << frame;
+      }
+    }
+    return out_string.str();
+  }
+  
+  PMCB saved_pmcb;
+  mem->get_PMCB(saved_pmcb);
+  mem->set_PMCB(PMCB());
+  
   uint32_t next_free = free_list_head;
   
   while (next_free != kEndList) {
     out_string << " " << std::hex << next_free;
-    memcpy(&next_free, &memory[next_free*kPageSize], sizeof(uint32_t));
+    mem->get_bytes(reinterpret_cast<uint8_t*>(&next_free), next_free*kPageSize, sizeof(uint32_t));
+  }
+  for (Addr frame = next_untouched; frame < page_frames_total; ++frame) {
+    out_string << " " << std::hex << frame;
   }
   
+  mem->set_PMCB(saved_pmcb);
   return out_string.str();
-}
\ No newline at end of file
+}
+
+void PageFrameAllocator::Save(SnapshotWriter &out, bool dirty_only) {
+  PMCB saved_pmcb;
+  mem->get_PMCB(saved_pmcb);
+  mem->set_PMCB(PMCB());
+  
+  /* Free frames, in the order they will be handed out: the list of freed
+   * frames (following its links), the untouched frames, the buddy blocks
+   * of each order, and the pre-zeroed pool */
+  std::vector<bool> is_free(page_frames_total, false);
+  std::vector<uint32_t> frames;
+  for (uint32_t frame = free_list_head; frame != kEndList; ) {
+    frames.push_back(frame);
+    is_free[frame] = true;
+    mem->get_bytes(reinterpret_cast<uint8_t*>(&frame), frame*kPageSize, sizeof(uint32_t));
+  }
+  out.Put32(zero_pool_target);
+  out.Put32(page_frames_free);
+  PutFrames(out, frames);
+  out.Put32(next_untouched);
+  std::fill(is_free.begin() + next_untouched, is_free.end(), true);
+  out.Put32(buddy_free.size());
+  for (uint32_t order = 0; order < buddy_free.size(); ++order) {
+    frames.assign(buddy_free[order].begin(), buddy_free[order].end());
+    PutFrames(out, frames);
+    for (uint32_t first : frames) {
+      std::fill(is_free.begin() + first, is_free.begin() + first + (1U << order), true);
+    }
+  }
+  PutFrames(out, zero_pool);
+  for (uint32_t frame : zero_pool) {
+    is_free[frame] = true;
+  }
+  std::map<uint32_t, uint32_t> references(extra_references.begin(), extra_references.end());
+  out.Put32(references.size());
+  for (const std::pair<const uint32_t, uint32_t> &reference : references) {
+    out.Put32(reference.first);
+    out.Put32(reference.second);
+  }
+  
+  /* Contents of the frames in use (or just those written since the last
+   * save), as runs of consecutive frames */
+  bool incremental = dirty_only && !dirty_log.empty();
+  std::vector<std::pair<uint32_t, uint32_t>> runs;
+  for (uint32_t frame = 0; frame < page_frames_total; ++frame) {
+    if (is_free[frame] || (incremental && !dirty_log[frame])) {
+      continue;
+    } else if (!runs.empty() && runs.back().first + runs.back().second == frame) {
+      ++runs.back().second;
+    } else {
+      runs.push_back(std::make_pair(frame, 1U));
+    }
+  }
+  out.Put32(runs.size());
+  std::vector<uint8_t> buffer(kSnapshotChunkFrames * kPageSize);
+  for (const std::pair<uint32_t, uint32_t> &run : runs) {
+    out.Put32(run.first);
+    out.Put32(run.second);
+    for (uint32_t done = 0; done < run.second; done += kSnapshotChunkFrames) {
+      uint32_t count = std::min(run.second - done, kSnapshotChunkFrames);
+      mem->get_bytes(buffer.data(), (run.first + done)*kPageSize, count*kPageSize);
+      out.PutBytes(buffer.data(), count*kPageSize);
+    }
+  }
+  std::fill(dirty_log.begin(), dirty_log.end(), false);
+  
+  mem->set_PMCB(saved_pmcb);
+}
+
+bool PageFrameAllocator::Load(SnapshotReader &in) {
+  if (in.get_frame_count() != page_frames_total || in.get_mode() != mode) {
+    return false;
+  }
+  PMCB saved_pmcb;
+  mem->get_PMCB(saved_pmcb);
+  mem->set_PMCB(PMCB());
+  
+  bool ok = true;
+  zero_pool_target = in.Get32();
+  page_frames_free = in.Get32();
+  
+  /* Relink the freed frames in their saved order */
+  std::vector<uint32_t> frames;
+  ok = ok && GetFrames(in, page_frames_total, frames);
+  free_list_head = kEndList;
+  if (ok && mode == kFreeList) {
+    for (std::vector<uint32_t>::const_reverse_iterator frame = frames.rbegin();
+         frame != frames.rend(); ++frame) {
+      ReturnFreeFrame(*frame);
+    }
+  }
+  next_untouched = in.Get32();
+  ok = ok && next_untouched <= page_frames_total && in.Get32() == buddy_free.size();
+  for (uint32_t order = 0; ok && order < buddy_free.size(); ++order) {
+    ok = GetFrames(in, page_frames_total, frames);
+    buddy_free[order] = std::set<uint32_t>(frames.begin(), frames.end());
+  }
+  
+  /* Pooled frames' contents aren't saved; clear them again */
+  ok = ok && GetFrames(in, page_frames_total, zero_pool);
+  for (uint32_t frame : zero_pool) {
+    ZeroFrame(frame);
+  }
+  extra_references.clear();
+  uint32_t references = ok ? in.Get32() : 0;
+  for (uint32_t i = 0; ok && i < references; ++i) {
+    uint32_t frame = in.Get32();
+    extra_references[frame] = in.Get32();
+    ok = !in.fail();
+  }
+  shared_frames = extra_references.size();
+  
+  /* Frame contents are copied straight from the mapped snapshot */
+  uint32_t runs = ok ? in.Get32() : 0;
+  for (uint32_t i = 0; ok && i < runs; ++i) {
+    uint32_t first = in.Get32();
+    uint32_t count = in.Get32();
+    ok = uint64_t(first) + count <= page_frames_total;
+    for (uint32_t done = 0; ok && done < count; done += kSnapshotChunkFrames) {
+      uint32_t chunk = std::min(count - done, kSnapshotChunkFrames);
+      const uint8_t *data = in.GetBytes(chunk*kPageSize);
+      if (data == nullptr) {
+        ok = false;
+      } else {
+        mem->put_bytes((first + done)*kPageSize, chunk*kPageSize, const_cast<uint8_t*>(data));
+      }
+    }
+  }
+  
+  mem->set_PMCB(saved_pmcb);
+  return ok && !in.fail();
+}
+
+bool PageFrameAllocator::TakeFreeFrame(uint32_t &frame) {
+  if (mode == kBuddy) {
+    return BuddyAllocBlock(0, frame);
+  } else if (free_list_head != kEndList) {
+    /* Unlink head frame */
+    frame = free_list_head;
+    mem->get_bytes(reinterpret_cast<uint8_t*>(&free_list_head), frame*kPageSize, sizeof(Addr));
+    return true;
+  } else if (next_untouched < page_frames_total) {
+    frame = next_untouched++;
+    return true;
+  }
+  return false;
+}
+
+void PageFrameAllocator::ZeroFrame(uint32_t frame) {
+  /* One page of zeros, written over the frame in a single call */
+  static const std::vector<uint8_t> zero_page(kPageSize, 0);
+  mem->put_bytes(frame*kPageSize, kPageSize, const_cast<uint8_t*>(zero_page.data()));
+  MarkDirty(frame);
+}
+
+bool PageFrameAllocator::BuddyAllocBlock(uint32_t order, uint32_t &frame) {
+  // Find the smallest non-empty order that can satisfy the request
+  uint32_t k = order;
+  while (k <= buddy_max_order && buddy_free[k].empty()) {
+    ++k;
+  }
+  if (k > buddy_max_order) {
+    return false;
+  }
+  
+  // Take the lowest-addressed block, splitting off upper halves as needed
+  frame = *buddy_free[k].begin();
+  buddy_free[k].erase(buddy_free[k].begin());
+  while (k > order) {
+    --k;
+    buddy_free[k].insert(frame + (1U << k));
+  }
+  return true;
+}
+
+void PageFrameAllocator::BuddyFreeBlock(uint32_t frame, uint32_t order) {
+  while (order < buddy_max_order) {
+    uint32_t buddy = frame ^ (1U << order);
+    if (buddy >= page_frames_total || buddy_free[order].erase(buddy) == 0) {
+      break;  // buddy in use (or split), stop merging
+    }
+    frame &= ~(1U << order);
+    ++order;
+  }
+  buddy_free[order].insert(frame);
+}
+
+void PageFrameAllocator::BuddyFreeRange(uint32_t first, uint32_t end) {
+  while (first < end) {
+    uint32_t order = 0;
+    while (order < buddy_max_order
+           && (first & ((2U << order) - 1)) == 0
+           && first + (2U << order) <= end) {
+      ++order;
+    }
+    BuddyFreeBlock(first, order);
+    first += 1U << order;
+  }
+}
@@ -9,23 +9,48 @@
 #ifndef PAGEFRAMEALLOCATOR_H
 #define PAGEFRAMEALLOCATOR_H
 
+#include <MMU.h>
+
 #include <cstdint>
+#include <set>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 using namespace mem;
 
+class SnapshotReader;
+class SnapshotWriter;
+
+/*
+ * The allocator is not thread-safe. It reads and writes the frames through
+ * the MMU, whose PMCB is global state, so callers that share an MMU must
+ * already be serialized. Independent runs each use their own MMU and
+ * allocator instead.
+ */
 class PageFrameAllocator {
 public:
+  /**
+   * Allocation backends
+   * 
+   *   kFreeList - singly linked free list threaded through the free frames
+   *   kBuddy - binary buddy system; can hand out physically contiguous,
+   *            power-of-two aligned runs and coalesces on Deallocate
+   */
+  enum Mode { kFreeList, kBuddy };
+  
   /**
    * Constructor
    * 
-   * Allocates the specified number of page frames, and builds free list of
-   * all page frames.
+   * Takes every page frame of the MMU as free. Takes constant time and
+   * touches no frame (in kBuddy mode, time and host memory are
+   * proportional to log2 of the frame count), so simulated memory can be
+   * large. Frames are handed out in ascending order until some are freed.
    * 
-   * @param page_frame_count
+   * @param mmu_mem MMU whose physical memory holds the page frames
+   * @param mode_ allocation backend to use
    */
-  PageFrameAllocator(MMU &mmu_mem);
+  PageFrameAllocator(MMU &mmu_mem, Mode mode_ = kFreeList);
   
   virtual ~PageFrameAllocator() {}  // empty destructor
   
@@ -38,15 +63,39 @@ public:
   /**
    * Allocate - allocate page frames from the free list
    * 
+   * The MMU must be in physical mode. Frames are taken from the pre-zeroed
+   * pool first; any others are cleared to all zeros with a single
+   * page-sized write before they are handed out.
+   * 
    * @param count number of page frames to allocate
    * @param page_frames page frame numbers allocated are pushed on back
    * @return true if success, false if insufficient page frames (no frames allocated)
    */
-  bool Allocate(uint32_t count);
+  bool Allocate(uint32_t count, std::vector<uint32_t> &page_frames);
+  
+  /**
+   * AllocateContiguous - allocate a physically contiguous run of page frames
+   * 
+   * Only supported in kBuddy mode. The run starts on a boundary aligned to
+   * count rounded up to a power of two; any frames of that block beyond
+   * count are returned to the allocator. The run is cleared with one write
+   * per kClearChunkFrames frames.
+   * 
+   * @param count number of page frames to allocate
+   * @param page_frames page frame numbers allocated are pushed on back, in
+   *   ascending order
+   * @return true if success, false if no contiguous run available or not in
+   *   kBuddy mode (no frames allocated)
+   */
+  bool AllocateContiguous(uint32_t count, std::vector<uint32_t> &page_frames);
   
   /**
    * Deallocate - return page frames to free list
    * 
+   * The MMU must be in physical mode (free-list links are written into the
+   * frames themselves). A frame with references added by AddReference just
+   * loses one reference; it is freed when its last owner deallocates it.
+   * 
    * @param count number of page frames to free
    * @param page_frames contains page frame numbers to deallocate; numbers are
    *   popped from back of vector
@@ -54,34 +103,190 @@ public:
    */
   bool Deallocate(uint32_t count, std::vector<uint32_t> &page_frames);
   
+  /**
+   * AddReference - record one more owner of an allocated frame (e.g. a
+   *   page shared copy-on-write), so it stays allocated until every owner
+   *   has deallocated it
+   * 
+   * @param frame page frame number
+   */
+  void AddReference(uint32_t frame);
+  
+  /**
+   * IsShared - test whether an allocated frame has more than one owner
+   * 
+   * @param frame page frame number
+   */
+  bool IsShared(uint32_t frame);
+  
+  /**
+   * Scrub - clear free frames into the pre-zeroed pool
+   * 
+   * Meant to be called while the simulation is otherwise idle (e.g. between
+   * trace commands), so that later Allocate calls find frames ready to hand
+   * out. Frames most recently freed are scrubbed first. The MMU is switched
+   * to physical mode while scrubbing and restored before returning.
+   * 
+   * @param max_frames upper bound on frames cleared by this call
+   * @return number of frames added to the pool
+   */
+  uint32_t Scrub(uint32_t max_frames);
+  
+  /**
+   * set_zero_pool_target - number of pre-zeroed frames Scrub keeps ready
+   *   (0 disables the pool, so all clearing happens inside Allocate)
+   */
+  void set_zero_pool_target(uint32_t target) { zero_pool_target = target; }
+  
   // Access to private values
+  Mode get_mode(void) const { return mode; }
+  uint32_t get_zero_pool_target(void) const { return zero_pool_target; }
+  uint32_t get_zero_pool_size(void) const { return zero_pool.size(); }
   uint32_t get_page_frames_free(void) const { return page_frames_free; }
-  Addr get_free_list_head(void) const { return free_list_head; }
+  Addr get_free_list_head(void) const {
+    return free_list_head != kEndList || next_untouched >= page_frames_total
+            ? free_list_head : next_untouched;
+  }
   
   /**
-   * FreeListToString - get string representation of free list
+   * FreeListToString - get string representation of free list. The MMU is
+   *   switched to physical mode to follow the links and restored afterwards.
    * 
    * @return hex numbers of all free pages
    */
   std::string FreeListToString(void) const;
   
+  /**
+   * Save - write the allocator's state and the contents of every frame in
+   *   use to a snapshot (see Snapshot.h). Free frames' contents are not
+   *   saved. The MMU is switched to physical mode while saving and restored
+   *   afterwards.
+   * 
+   * @param out snapshot being written
+   * @param dirty_only if the dirty log is enabled (see EnableDirtyLog),
+   *   save only the frames in use that it marks; the log is cleared
+   *   either way
+   */
+  void Save(SnapshotWriter &out, bool dirty_only = false);
+  
+  /**
+   * Load - restore the state and frame contents written by Save, replacing
+   *   the current state (including the pre-zeroed pool target). The MMU must
+   *   have the frame count, and the allocator the mode, given in the
+   *   snapshot header. The MMU is switched to physical mode while loading
+   *   and restored afterwards.
+   * 
+   * @param in snapshot being read
+   * @return true if success, false if the snapshot is corrupt
+   */
+  bool Load(SnapshotReader &in);
+  
+  /**
+   * EnableDirtyLog - start recording which frames are written through
+   *   physical addresses, by the allocator itself and by callers of
+   *   MarkDirty, for incremental saves. Writes through virtual addresses
+   *   are not seen here; they show in the pages' Modified bits.
+   */
+  void EnableDirtyLog(void) { dirty_log.assign(page_frames_total, false); }
+  
+  /**
+   * MarkDirty - record a physical write to a frame (ignored unless the
+   *   dirty log is enabled)
+   */
+  void MarkDirty(uint32_t frame) {
+    if (!dirty_log.empty()) dirty_log[frame] = true;
+  }
+  
   static const uint32_t kPageSize = 0x1000;
+  static const uint32_t kClearChunkFrames = 64;
 private:
-  // Vector to hold memory to be allocated
-  std::vector<uint8_t> memory;
-  
-  // Number of first free page frame
+  // Number of first free page frame on the list of freed frames, and the
+  // first frame never handed out (all frames above it are free too)
   Addr free_list_head;
+  Addr next_untouched;
   
   // Total number of page frames
   Addr page_frames_total;
   
-  // Current number of free page frames
+  // Current number of free page frames (including the pre-zeroed pool)
   Addr page_frames_free;
   
+  // Owners beyond the first of each shared frame (frames with a single
+  // owner aren't listed), and number of frames listed
+  std::unordered_map<uint32_t, uint32_t> extra_references;
+  uint32_t shared_frames;
+  
+  // Frames written since the last Save, by frame number (empty if the
+  // dirty log is disabled)
+  std::vector<bool> dirty_log;
+  
+  // Free frames already cleared by Scrub, and how many to keep there
+  std::vector<uint32_t> zero_pool;
+  uint32_t zero_pool_target;
+  
   //MMU pointer
   MMU *mem;
   
+  // Allocation backend
+  Mode mode;
+  
+  /**
+   * DropReference - remove one extra owner of a frame, if it has any
+   * 
+   * @return true if the frame had extra owners (and so must not be freed)
+   */
+  bool DropReference(uint32_t frame);
+  
+  /**
+   * ReturnFreeFrame - put one frame back on the free list or buddy lists
+   *   (does not adjust page_frames_free). The MMU must be in physical mode.
+   */
+  void ReturnFreeFrame(uint32_t frame);
+  
+  /**
+   * TakeFreeFrame - remove one frame from the free list or buddy lists
+   *   (does not adjust page_frames_free or clear the frame)
+   * 
+   * @param frame returns frame number
+   * @return true if success, false if no free frame outside the pool
+   */
+  bool TakeFreeFrame(uint32_t &frame);
+  
+  /**
+   * ZeroFrame - clear a page frame with a single page-sized write
+   */
+  void ZeroFrame(uint32_t frame);
+  
+  // Buddy system state (kBuddy mode only): free block start frames for each
+  // order
+  std::vector<std::set<uint32_t>> buddy_free;
+  uint32_t buddy_max_order;
+  
+  /**
+   * BuddyAllocBlock - remove a free block of 2^order frames, splitting a
+   *   larger block if necessary
+   * 
+   * @param order log2 of block size in frames
+   * @param frame returns first frame of block
+   * @return true if success, false if no block large enough
+   */
+  bool BuddyAllocBlock(uint32_t order, uint32_t &frame);
+  
+  /**
+   * BuddyFreeBlock - return a block of 2^order frames, merging it with its
+   *   buddy for as long as the buddy is also free
+   * 
+   * @param frame first frame of block
+   * @param order log2 of block size in frames
+   */
+  void BuddyFreeBlock(uint32_t frame, uint32_t order);
+  
+  /**
+   * BuddyFreeRange - return an arbitrary run of frames as the largest
+   *   aligned blocks that fit
+   */
+  void BuddyFreeRange(uint32_t first, uint32_t end);
+  
   // End of list marker
   static const Addr kEndList = 0xFFFFFFFF;
 };
@@ -0,0 +1,185 @@
+/*
+ * Pager implementation
+ */
+
+/* 
+ * File:   Pager.cpp
+ */
+
+#include "Pager.h"
+#include "ProcessTrace.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+const uint32_t Pager::kNoSlot;
+
+Pager::Pager(mem::MMU &memory_, PageFrameAllocator &allocator_,
+             const std::string &swap_file_name_)
+: memory(&memory_), allocator(&allocator_), swap_file_name(swap_file_name_),
+  resident_pages(0), hand(0), evictions(0), swap_outs(0), swap_ins(0),
+  second_chances(0), page_buffer(mem::kPageSize) {
+  swap_fd = open(swap_file_name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+  frames.resize(memory->get_frame_count());
+  for (FramePage &page : frames) {
+    page.slot = kNoSlot;
+  }
+}
+
+Pager::~Pager(void) {
+  if (swap_fd >= 0) {
+    close(swap_fd);
+    unlink(swap_file_name.c_str());
+  }
+}
+
+void Pager::Register(uint32_t frame, ProcessTrace *owner, Addr vaddr, uint32_t slot) {
+  FramePage &page = frames[frame];
+  if (page.slot != kNoSlot) {
+    ReleaseSlot(page.slot);
+  }
+  if (page.owners.empty()) {
+    ++resident_pages;
+  }
+  page.owners.assign(1, std::make_pair(owner, vaddr));
+  page.slot = slot;
+}
+
+void Pager::AddOwner(uint32_t frame, ProcessTrace *owner, Addr vaddr) {
+  FramePage &page = frames[frame];
+  if (!page.owners.empty()) {
+    page.owners.push_back(std::make_pair(owner, vaddr));
+  }
+}
+
+void Pager::Unregister(uint32_t frame, ProcessTrace *owner) {
+  FramePage &page = frames[frame];
+  for (size_t i = 0; i < page.owners.size(); ++i) {
+    if (page.owners[i].first == owner) {
+      page.owners.erase(page.owners.begin() + i);
+      if (page.owners.empty()) {
+        --resident_pages;
+      }
+      break;
+    }
+  }
+  if (page.owners.empty() && page.slot != kNoSlot) {
+    ReleaseSlot(page.slot);
+    page.slot = kNoSlot;
+  }
+}
+
+void Pager::ReleaseSlot(uint32_t slot) {
+  if (--slot_references[slot] == 0) {
+    free_slots.push_back(slot);
+  }
+}
+
+bool Pager::Reclaim(uint32_t count) {
+  if (swap_fd < 0 || allocator->get_page_frames_free() + resident_pages < count) {
+    return false;
+  }
+  
+  /* Two full turns of the hand: the first may only clear Accessed bits */
+  uint32_t steps = 2 * frames.size();
+  while (allocator->get_page_frames_free() < count && steps-- > 0) {
+    uint32_t frame = hand;
+    hand = (hand + 1) % frames.size();
+    
+    FramePage &page = frames[frame];
+    if (page.owners.empty()) {
+      continue;  // not an evictable page
+    }
+    
+    /* Used recently by any owner: clear all the Accessed bits and pass */
+    bool accessed = false;
+    bool modified = false;
+    for (std::pair<ProcessTrace*, Addr> &owner : page.owners) {
+      bool owner_modified;
+      accessed |= owner.first->AgePage(owner.second, owner_modified);
+      modified |= owner_modified;
+    }
+    if (accessed) {
+      ++second_chances;
+      continue;
+    }
+    if (!Evict(frame, modified)) {
+      return false;
+    }
+  }
+  return allocator->get_page_frames_free() >= count;
+}
+
+bool Pager::Evict(uint32_t frame, bool modified) {
+  FramePage &page = frames[frame];
+  
+  /* An unmodified page already in the swap file just reuses its copy. A
+   * modified page overwrites its old slot unless another process still
+   * refers to that copy. */
+  uint32_t slot = page.slot;
+  if (slot == kNoSlot || modified) {
+    if (slot != kNoSlot && slot_references[slot] > 1) {
+      ReleaseSlot(slot);
+      slot = kNoSlot;
+    }
+    if (slot == kNoSlot) {
+      slot = NewSlot();
+    }
+    memory->get_bytes(page_buffer.data(), frame * mem::kPageSize, mem::kPageSize);
+    off_t offset = off_t(slot) * mem::kPageSize;
+    if (pwrite(swap_fd, page_buffer.data(), mem::kPageSize, offset) != ssize_t(mem::kPageSize)) {
+      ReleaseSlot(slot);
+      page.slot = kNoSlot;
+      return false;
+    }
+    ++swap_outs;
+  }
+  
+  /* Each owner's L2 entry now holds a reference to the slot, and each
+   * owner's reference to the frame is dropped */
+  std::vector<std::pair<ProcessTrace*, Addr>> owners;
+  owners.swap(page.owners);
+  page.slot = kNoSlot;
+  --resident_pages;
+  for (size_t i = 0; i < owners.size(); ++i) {
+    if (i > 0) {
+      ShareSlot(slot);
+    }
+    owners[i].first->SwapOutPage(owners[i].second, slot);
+  }
+  std::vector<uint32_t> freed(owners.size(), frame);
+  allocator->Deallocate(freed.size(), freed);
+  ++evictions;
+  return true;
+}
+
+bool Pager::SwapIn(uint32_t slot, uint32_t frame) {
+  off_t offset = off_t(slot) * mem::kPageSize;
+  if (pread(swap_fd, page_buffer.data(), mem::kPageSize, offset) != ssize_t(mem::kPageSize)) {
+    return false;
+  }
+  memory->put_bytes(frame * mem::kPageSize, mem::kPageSize, page_buffer.data());
+  allocator->MarkDirty(frame);
+  ++swap_ins;
+  return true;
+}
+
+uint32_t Pager::NewSlot(void) {
+  uint32_t slot;
+  if (!free_slots.empty()) {
+    slot = free_slots.back();
+    free_slots.pop_back();
+  } else {
+    slot = slot_references.size();
+    slot_references.push_back(0);
+  }
+  slot_references[slot] = 1;
+  return slot;
+}
+
+void Pager::Report(std::ostream &out) const {
+  out << "pager: " << std::dec << evictions << " evictions, " << swap_outs
+      << " swap-outs, " << swap_ins << " swap-ins, " << second_chances
+      << " second chances, " << slot_references.size() - free_slots.size()
+      << " swap slots in use\n";
+}
@@ -0,0 +1,178 @@
+/*
+ * Pager - page eviction to a swap file
+ * 
+ * When the allocator runs out of page frames, the pager picks victim pages
+ * with the clock (second chance) algorithm: the hand sweeps over the page
+ * frames, and a page whose Accessed bit is set has the bit cleared and is
+ * passed over once. A victim is written to a slot in the swap file only if
+ * it was modified since it was last read from its slot (or has never been
+ * swapped out); its L2 entry is then made non-present, holding the slot
+ * number, and its frame is freed. The page is read back in when the
+ * process next faults on it.
+ * 
+ * Only data pages are evicted; page directories and L2 tables stay
+ * resident. A page shared by fork is evicted from all of its owners at
+ * once, and each is left referring to the same slot.
+ */
+
+/* 
+ * File:   Pager.h
+ */
+
+#ifndef PAGER_H
+#define PAGER_H
+
+#include <MMU.h>
+#include "PageFrameAllocator.h"
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+class ProcessTrace;
+
+class Pager {
+public:
+  /**
+   * Constructor - create the swap file (replacing any existing file)
+   * 
+   * @param memory_ MMU holding the page frames
+   * @param allocator_ allocator the frames are freed to
+   * @param swap_file_name_ path of swap file; removed by the destructor
+   */
+  Pager(mem::MMU &memory_, PageFrameAllocator &allocator_,
+        const std::string &swap_file_name_);
+  
+  /**
+   * Destructor - close and remove swap file
+   */
+  virtual ~Pager(void);
+  
+  // Disallow copy/move
+  Pager(const Pager &other) = delete;
+  Pager(Pager &&other) = delete;
+  Pager &operator=(const Pager &other) = delete;
+  Pager &operator=(Pager &&other) = delete;
+  
+  /**
+   * is_open - true if the swap file was created
+   */
+  bool is_open(void) const { return swap_fd >= 0; }
+  
+  /**
+   * Register - make a resident data page a candidate for eviction, with a
+   *   single owner
+   * 
+   * @param frame page frame holding the page
+   * @param owner process mapping the page
+   * @param vaddr virtual address of the page in owner
+   * @param slot swap slot holding an identical copy of the page (the slot
+   *   it was just read from), or kNoSlot; the reference to the slot passes
+   *   to the pager
+   */
+  void Register(uint32_t frame, ProcessTrace *owner, Addr vaddr,
+                uint32_t slot = kNoSlot);
+  
+  /**
+   * AddOwner - record another process mapping a registered frame (e.g. a
+   *   child sharing it after fork)
+   */
+  void AddOwner(uint32_t frame, ProcessTrace *owner, Addr vaddr);
+  
+  /**
+   * Unregister - remove an owner that is unmapping a frame (no effect if it
+   *   is not an owner); the page is forgotten once it has no owners
+   */
+  void Unregister(uint32_t frame, ProcessTrace *owner);
+  
+  /**
+   * Reclaim - evict pages until the allocator has at least count free
+   *   frames. Nothing is evicted if that many could not be freed even by
+   *   evicting every page. The MMU must be in physical mode.
+   * 
+   * @return true if enough frames are free
+   */
+  bool Reclaim(uint32_t count);
+  
+  /**
+   * SwapIn - read a page back from the swap file. The MMU must be in
+   *   physical mode.
+   * 
+   * @param slot swap slot holding the page
+   * @param frame page frame to read it into
+   * @return true if success
+   */
+  bool SwapIn(uint32_t slot, uint32_t frame);
+  
+  /**
+   * ShareSlot, ReleaseSlot - add or drop a reference to a swap slot (one
+   *   per non-present L2 entry holding it, and one for a registered page
+   *   it is a clean copy of); a slot is reused once unreferenced
+   */
+  void ShareSlot(uint32_t slot) { ++slot_references[slot]; }
+  void ReleaseSlot(uint32_t slot);
+  
+  /**
+   * Report - write paging counters
+   * 
+   * @param out stream to write report to
+   */
+  void Report(std::ostream &out) const;
+  
+  // Slot value meaning none
+  static const uint32_t kNoSlot = 0xFFFFFFFF;
+  
+private:
+  // MMU and allocator
+  mem::MMU *memory;
+  PageFrameAllocator *allocator;
+  
+  // Swap file
+  std::string swap_file_name;
+  int swap_fd;
+  
+  // Resident data page held by each frame: processes mapping it and where
+  // (empty if none), and slot holding a clean copy (or kNoSlot)
+  struct FramePage {
+    std::vector<std::pair<ProcessTrace*, Addr>> owners;
+    uint32_t slot;
+  };
+  std::vector<FramePage> frames;
+  
+  // Number of frames with owners (the most Reclaim can free)
+  uint32_t resident_pages;
+  
+  // Clock hand: next frame to examine
+  uint32_t hand;
+  
+  // References to each slot in the file, and unreferenced slots
+  std::vector<uint32_t> slot_references;
+  std::vector<uint32_t> free_slots;
+  
+  // Counters
+  uint64_t evictions;       // pages evicted
+  uint64_t swap_outs;       // evicted pages written to the swap file
+  uint64_t swap_ins;        // pages read back (major faults)
+  uint64_t second_chances;  // Accessed bits cleared by the clock hand
+  
+  // Buffer for one page
+  std::vector<uint8_t> page_buffer;
+  
+  /**
+   * Evict - evict the page in a registered frame from all of its owners
+   *   and free the frame
+   * 
+   * @return true if success
+   */
+  bool Evict(uint32_t frame, bool modified);
+  
+  /**
+   * NewSlot - take an unreferenced slot (extending the file if needed),
+   *   with one reference
+   */
+  uint32_t NewSlot(void);
+};
+
+#endif /* PAGER_H */
@@ -9,114 +9,917 @@
  */
 
 #include "ProcessTrace.h"
+#include "Snapshot.h"
 
 #include <algorithm>
 #include <cctype>
-#include <iomanip>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <functional>
 #include <iostream>
-#include <sstream>
 
 using namespace mem;
 using std::cin;
-using std::cout;
-using std::cerr;
-using std::getline;
-using std::istringstream;
 using std::string;
 using std::vector;
 
-ProcessTrace::ProcessTrace(std::string file_name_, MMU &memory_, PageFrameAllocator &allocator_)
-: file_name(file_name_), line_number(0) {
-    // Open the trace file.  Abort program if can't open.
-    trace.open(file_name, std::ios_base::in);
-    if (!trace.is_open()) {
-        cerr << "ERROR: failed to open trace file: " << file_name << "\n";
-        exit(2);
+const Addr ProcessTrace::kNewDirectory;
+
+ProcessTrace::ProcessTrace(std::string file_name_, MMU &memory_, PageFrameAllocator &allocator_,
+                           std::ostream &out_, std::ostream &err_)
+: ProcessTrace(file_name_, std::make_shared<TraceProgram>(file_name_), 0,
+               memory_, allocator_, out_, err_, kNewDirectory) {
+}
+
+ProcessTrace::ProcessTrace(const std::string &file_name_,
+                           std::shared_ptr<const TraceProgram> program_, size_t pc_,
+                           MMU &memory_, PageFrameAllocator &allocator_,
+                           std::ostream &out_, std::ostream &err_, Addr directory)
+: file_name(file_name_), program(program_), pc(pc_), line_number(0),
+  output(out_), error(err_), put_done(false), demand_paging(false),
+  pager(nullptr), forks(0), stats(nullptr) {
+    // Abort if trace file couldn't be opened or isn't a trace
+    if (!program->ok()) {
+        Abort(program->get_error(), 2);
     }
     memory = &memory_;
     allocator = &allocator_;
+    shadow_dir.fill(0);
+    shadow_l2.resize(kPageTableEntries);
     
+    // A restored process's directory and tables are already in memory
+    if (directory != kNewDirectory) {
+        page_directory_base = directory;
+        process_pmcb = PMCB(true, directory);
+        return;
+    }
     
-    //Build an empty page-directory
-    PageTable page_directory;
+    //Build an empty page-directory (Allocate hands back a zeroed frame)
     memory->set_PMCB(physical_pmcb);
-    Addr directory_physical = allocator->get_free_list_head() * mem::kPageSize;
-    allocator->Allocate(1);
-    memory->put_bytes(directory_physical, kPageTableSizeBytes, //Write page directory to memory
-            reinterpret_cast<uint8_t*> (&page_directory));
+    vector<uint32_t> directory_frame;
+    if (!allocator->Allocate(1, directory_frame)) {
+        Abort("ERROR: no page frame available for page directory\n", 2);
+    }
+    Addr directory_physical = directory_frame[0] * mem::kPageSize;
+    page_directory_base = directory_physical;
     // load to start virtual mode
-    const PMCB virtual_pmcb(true, directory_physical);
-    memory->set_PMCB(virtual_pmcb);  
+    process_pmcb = PMCB(true, directory_physical);
+    memory->set_PMCB(process_pmcb);  
 }
 
 ProcessTrace::~ProcessTrace() {
-    trace.close();
+    /* Close the working-set time series and write the report */
+    if (sampler) {
+        if (sampler->SamplePending()) {
+            SamplePages();
+        }
+        std::ofstream report(report_file);
+        sampler->WriteJson(report, file_name);
+    }
+    
+    /* Collect every frame this process owns from its shadow tables and
+     * return them all in one call */
+    vector<uint32_t> frames;
+    for (Addr dir_index = 0; dir_index < kPageTableEntries; ++dir_index) {
+        const PageTable *l2 = shadow_l2[dir_index].get();
+        if (!l2) {
+            continue;
+        }
+        for (Addr i = 0; i < kPageTableEntries; ++i) {
+            PageTableEntry pte = (*l2)[i];
+            if (pte & kPTE_PresentMask) {
+                frames.push_back(pte >> kPageSizeBits);
+                if (pager) pager->Unregister(pte >> kPageSizeBits, this);
+            } else if (pte & kPTE_SwappedMask) {
+                pager->ReleaseSlot(pte >> kPageSizeBits);
+            }
+        }
+        frames.push_back(shadow_dir[dir_index] >> kPageSizeBits);
+    }
+    frames.push_back(page_directory_base >> kPageSizeBits);
+    
+    PMCB temp_pmcb;
+    memory->get_PMCB(temp_pmcb);
+    memory->set_PMCB(physical_pmcb);
+    DeallocateFrames(frames);
+    
+    /* Don't leave the MMU translating through the freed directory */
+    if (!temp_pmcb.vm_enable || temp_pmcb.page_table_base != page_directory_base) {
+        memory->set_PMCB(temp_pmcb);
+    }
 }
 
 void ProcessTrace::Execute(void) {
-    // Read and process commands
-    string line; // text line read
-    string cmd; // command from line
-    vector<uint32_t> cmdArgs; // arguments from line
-
-    // Select the command to execute
-    while (ParseCommand(line, cmd, cmdArgs)) {
-        if (cmd == "alloc") {
-            CmdAlloc(line, cmd, cmdArgs); // allocate memory
-        } else if (cmd == "compare") {
-            CmdCompare(line, cmd, cmdArgs); // get and compare multiple bytes
-        } else if (cmd == "put") {
-            CmdPut(line, cmd, cmdArgs); // put bytes
-        } else if (cmd == "fill") {
-            CmdFill(line, cmd, cmdArgs); // fill bytes with value
-        } else if (cmd == "copy") {
-            CmdCopy(line, cmd, cmdArgs); // copy bytes to dest from source
-        } else if (cmd == "dump") {
-            CmdDump(line, cmd, cmdArgs); // dump byte values to output
-        } else if (cmd == "writable") {
-            CmdWritable(line, cmd, cmdArgs);
-        } else if (cmd == "#") {
-            CmdComment(line);
-        } else {
-            cerr << "ERROR: invalid command at line " << line_number << ":\n"
-                    << line << "\n";
-            exit(2);
+    while (Step()) {
+    }
+}
+
+bool ProcessTrace::Step(void) {
+    // At end of trace, push out remaining output
+    if (pc == program->size()) {
+        if (program->get_end() == TraceProgram::kReadFailed) {
+            Abort("ERROR: read failed on trace file: " + file_name
+                    + "at line " + std::to_string(line_number) + "\n", 2);
+        } else if (program->get_end() == TraceProgram::kCorrupt) {
+            Abort("ERROR: corrupt compiled trace file: " + file_name
+                    + " after line " + std::to_string(line_number) + "\n", 2);
+        }
+        output.Flush();
+        return false;
+    }
+    
+    // Echo the line number and command line
+    const Instruction &ins = (*program)[pc++];
+    line_number = ins.line_number;
+    output.AppendDecimal(line_number);
+    output.Append(':');
+    output.Append(program->Text(ins), ins.text_length);
+    output.Append('\n');
+
+    std::chrono::steady_clock::time_point start;
+    uint64_t bytes_before = 0;
+    if (stats) {
+        bytes_before = stats->counters.bytes_read + stats->counters.bytes_written;
+        start = std::chrono::steady_clock::now();
+    }
+
+    // Execute the command. A fused compare reads back what the put just
+    // wrote, so it is skipped, except when sampling (for the Accessed bits).
+    bool skip_compare = ins.fused && put_done && !sampler;
+    put_done = false;
+    try {
+        switch (ins.opcode) {
+            case BinaryTrace::kAlloc:
+                CmdAlloc(ins); // allocate memory
+                break;
+            case BinaryTrace::kCompare:
+                if (!skip_compare) {
+                    CmdCompare(ins); // get and compare multiple bytes
+                }
+                break;
+            case BinaryTrace::kPut:
+                CmdPut(ins); // put bytes
+                break;
+            case BinaryTrace::kFill:
+                CmdFill(ins); // fill bytes with value
+                break;
+            case BinaryTrace::kCopy:
+                CmdCopy(ins); // copy bytes to dest from source
+                break;
+            case BinaryTrace::kDump:
+                CmdDump(ins); // dump byte values to output
+                break;
+            case BinaryTrace::kWritable:
+                CmdWritable(ins);
+                break;
+            case BinaryTrace::kFree:
+                CmdFree(ins); // unmap and release pages
+                break;
+            case BinaryTrace::kFork:
+                CmdFork(ins); // clone process copy-on-write
+                break;
+            case BinaryTrace::kComment:
+                break;
+            default:
+                Abort("ERROR: invalid command at line " + std::to_string(line_number)
+                        + ":\n" + std::string(program->Text(ins), ins.text_length) + "\n", 2);
+        }
+    } catch (PageFaultException &e) {
+        ReportFault("PageFaultException", e);
+    } catch (WritePermissionFaultException &e) {
+        ReportFault("WritePermissionFaultException", e);
+    }
+    
+    if (stats) {
+        stats->RecordCommand(ins.opcode,
+                std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now() - start).count(),
+                stats->counters.bytes_read + stats->counters.bytes_written - bytes_before,
+                skip_compare);
+    }
+        
+    if (sampler && sampler->CommandDone()) {
+        SamplePages();
+    }
+        
+    // Refill the allocator's pre-zeroed pool between commands
+    allocator->Scrub(kScrubFramesPerCommand);
+    return true;
+}
+
+void ProcessTrace::SwitchIn(void) {
+    memory->set_PMCB(process_pmcb);
+}
+
+void ProcessTrace::SwitchOut(void) {
+    memory->get_PMCB(process_pmcb);
+    output.Flush();
+}
+
+void ProcessTrace::ReportFault(const char *type,
+        const MemorySubsystemException &e) {
+    if (stats) ++stats->counters.faults_reported;
+    output.Append("Exception type ");
+    output.Append(type);
+    output.Append(" occurred at input line ");
+    output.AppendDecimal(line_number);
+    output.Append(" at virtual address 0x");
+    output.AppendHex(e.GetVirtualAddress());
+    output.Append(": ");
+    output.Append(e.what());
+    output.Append('\n');
+    
+    // Cancel the partially executed operation so it doesn't fault again
+    PMCB pmcb;
+    memory->get_PMCB(pmcb);
+    pmcb.operation_state = PMCB::NONE;
+    memory->set_PMCB(pmcb);
+}
+
+void ProcessTrace::Abort(const string &message, int exit_status) {
+    // Output so far goes out ahead of the error, as with the unbuffered streams
+    output.Flush();
+    error << message;
+    error.flush();
+    throw TraceError(message, exit_status);
+}
+
+void ProcessTrace::GetBytes(uint8_t *dest, Addr vaddr, Addr count) {
+    for (;;) {
+        try {
+            if (stats) ++stats->counters.mmu_calls;
+            memory->get_bytes(dest, vaddr, count);
+            if (stats) stats->counters.bytes_read += count;
+            return;
+        } catch (PageFaultException &e) {
+            // Retry the whole operation once the faulting page is backed
+            if (stats) ++stats->counters.page_faults;
+            if (!SwapInPage(e.GetVirtualAddress())
+                    && !MapDemandPage(e.GetVirtualAddress())) throw;
+        }
+    }
+}
+
+void ProcessTrace::PutBytes(Addr vaddr, Addr count, uint8_t *src) {
+    for (;;) {
+        try {
+            if (stats) ++stats->counters.mmu_calls;
+            memory->put_bytes(vaddr, count, src);
+            if (stats) stats->counters.bytes_written += count;
+            return;
+        } catch (PageFaultException &e) {
+            // Retry the whole operation once the faulting page is backed
+            if (stats) ++stats->counters.page_faults;
+            if (!SwapInPage(e.GetVirtualAddress())
+                    && !MapDemandPage(e.GetVirtualAddress())) throw;
+        } catch (WritePermissionFaultException &e) {
+            // Retry once the page has been made private and writable
+            if (stats) ++stats->counters.write_faults;
+            if (!BreakCopyOnWrite(e.GetVirtualAddress())) throw;
+        }
+    }
+}
+
+std::unique_ptr<ProcessTrace> ProcessTrace::Fork(void) {
+    /* The child needs a page directory plus a copy of each L2 table; check
+     * up front so a fork that can't complete changes nothing */
+    uint32_t num_tables = 0;
+    for (const std::unique_ptr<PageTable> &l2 : shadow_l2) {
+        if (l2) ++num_tables;
+    }
+    PMCB temp_pmcb;
+    memory->get_PMCB(temp_pmcb);
+    temp_pmcb.operation_state = PMCB::NONE;
+    memory->set_PMCB(physical_pmcb);
+    if (allocator->get_page_frames_free() < 1 + num_tables
+            && !(pager && pager->Reclaim(1 + num_tables))) {
+        memory->set_PMCB(temp_pmcb);
+        return nullptr;
+    }
+    
+    std::unique_ptr<ProcessTrace> child(new ProcessTrace(
+            file_name, program, pc, *memory, *allocator, output.get_stream(), error,
+            kNewDirectory));
+    child->pager = pager;
+    child->set_stats(stats);
+    if (stats) stats->counters.frames_allocated += num_tables;
+    if (sampler) {
+        std::string::size_type dot = report_file.rfind('.');
+        if (dot == std::string::npos || report_file.find('/', dot) != std::string::npos) {
+            dot = report_file.size();
         }
+        child->set_sampling(sampler->get_interval(), report_file.substr(0, dot)
+                + "." + std::to_string(++forks) + report_file.substr(dot));
+    }
+    child->demand_paging = demand_paging;
+    child->reserved = reserved;
+    child->demand_readonly = demand_readonly;
+    
+    /* Set to physical -- we're writing physical page table entries */
+    memory->set_PMCB(physical_pmcb);
+    vector<uint32_t> frames;
+    if (!allocator->Allocate(num_tables, frames)) {
+        child.reset();
+        memory->set_PMCB(temp_pmcb);
+        return nullptr;
+    }
+    vector<uint32_t>::const_iterator next_frame = frames.begin();
+    for (Addr dir_index = 0; dir_index < kPageTableEntries; ++dir_index) {
+        if (!shadow_l2[dir_index]) {
+            continue;
+        }
+        
+        /* Share every page; writable ones become copy-on-write in the
+         * parent, and the child's table starts as a copy of the result */
+        PageTable &l2 = *shadow_l2[dir_index];
+        Addr changed_first = kPageTableEntries;
+        Addr changed_end = 0;
+        for (Addr i = 0; i < kPageTableEntries; ++i) {
+            if (l2[i] & kPTE_SwappedMask) {
+                pager->ShareSlot(l2[i] >> kPageSizeBits);  // both refer to the copy
+            }
+            if (!(l2[i] & kPTE_PresentMask)) {
+                continue;
+            }
+            allocator->AddReference(l2[i] >> kPageSizeBits);
+            if (pager) {
+                pager->AddOwner(l2[i] >> kPageSizeBits, child.get(),
+                        (dir_index << (kPageSizeBits + kPageTableSizeBits)) | (i << kPageSizeBits));
+            }
+            if (l2[i] & kPTE_WritableMask) {
+                l2[i] = (l2[i] & ~kPTE_WritableMask) | kPTE_CopyOnWriteMask;
+                changed_first = std::min(changed_first, i);
+                changed_end = i + 1;
+            }
+        }
+        if (changed_first < changed_end) {
+            MarkL2Dirty(dir_index, changed_first, changed_end - changed_first);
+        }
+        
+        child->SetDirEntry(dir_index, (*next_frame++ * kPageSize)
+                | (shadow_dir[dir_index] & (kPTE_PresentMask | kPTE_WritableMask)));
+        *child->shadow_l2[dir_index] = l2;
+        child->MarkL2Dirty(dir_index, 0, kPageTableEntries);
     }
+    FlushPageTables();
+    child->FlushPageTables();
+    
+    memory->set_PMCB(temp_pmcb);
+    return child;
 }
 
-bool ProcessTrace::ParseCommand(
-        string &line, string &cmd, vector<uint32_t> &cmdArgs) {
-    cmdArgs.clear();
-    line.clear();
+void ProcessTrace::TakeChildren(std::vector<std::unique_ptr<ProcessTrace>> &forked) {
+    for (std::unique_ptr<ProcessTrace> &child : children) {
+        forked.push_back(std::move(child));
+    }
+    children.clear();
+}
 
-    // Read next line
-    if (std::getline(trace, line)) {
-        ++line_number;
-        cout << std::dec << line_number << ":";
+void ProcessTrace::Save(SnapshotWriter &out) {
+    /* Page tables live in the saved frames; make sure they're current */
+    if (!dirty_ptes.empty()) {
+        PMCB temp_pmcb;
+        memory->get_PMCB(temp_pmcb);
+        memory->set_PMCB(physical_pmcb);
+        FlushPageTables();
+        memory->set_PMCB(temp_pmcb);
+    }
+    
+    out.PutString(file_name);
+    out.Put64(program->size());
+    out.Put64(pc);
+    out.Put32(line_number);
+    out.Put32(put_done);
+    out.Put32(page_directory_base);
+    out.Put32(demand_paging);
+    out.Put32(reserved.size());
+    for (const std::pair<const Addr, uint64_t> &range : reserved) {
+        out.Put32(range.first);
+        out.Put64(range.second);
+    }
+    out.Put32(demand_readonly.size());
+    for (Addr page : demand_readonly) {
+        out.Put32(page);
+    }
+}
 
-        // Make a string stream from command line
-        istringstream lineStream(line);
+std::unique_ptr<ProcessTrace> ProcessTrace::Load(SnapshotReader &in, ProgramCache &programs,
+        MMU &memory_, PageFrameAllocator &allocator_,
+        std::ostream &out_, std::ostream &err_) {
+    std::string name = in.GetString();
+    uint64_t program_size = in.Get64();
+    uint64_t pc_ = in.Get64();
+    long line_number_ = in.Get32();
+    bool put_done_ = in.Get32();
+    Addr directory = in.Get32();
+    bool demand_paging_ = in.Get32();
+    std::map<Addr, uint64_t> reserved_;
+    uint32_t ranges = in.Get32();
+    for (uint32_t i = 0; i < ranges && !in.fail(); ++i) {
+        Addr start = in.Get32();
+        reserved_[start] = in.Get64();
+    }
+    std::set<Addr> demand_readonly_;
+    uint32_t readonly = in.Get32();
+    for (uint32_t i = 0; i < readonly && !in.fail(); ++i) {
+        demand_readonly_.insert(in.Get32());
+    }
+    uint64_t memory_size = uint64_t(memory_.get_frame_count()) * kPageSize;
+    if (in.fail() || pc_ > program_size || directory >= memory_size
+            || (directory & (kPageSize - 1)) != 0) {
+        return nullptr;
+    }
+    
+    /* Read the page tables back from the restored frames, without the
+     * Accessed/Modified bits (the shadow never holds them) */
+    const PageTableEntry kHardwareBits = kPTE_AccessedMask | kPTE_ModifiedMask;
+    PageTable dir;
+    std::vector<std::unique_ptr<PageTable>> l2_tables(kPageTableEntries);
+    PMCB temp_pmcb;
+    memory_.get_PMCB(temp_pmcb);
+    memory_.set_PMCB(PMCB());
+    memory_.get_bytes(reinterpret_cast<uint8_t*> (dir.data()), directory, kPageTableSizeBytes);
+    bool tables_ok = true;
+    for (Addr dir_index = 0; dir_index < kPageTableEntries && tables_ok; ++dir_index) {
+        dir[dir_index] &= ~kHardwareBits;
+        Addr table_paddr = dir[dir_index] & 0xFFFFF000;
+        if (!(dir[dir_index] & kPTE_PresentMask)) {
+            continue;
+        } else if (table_paddr >= memory_size) {
+            tables_ok = false;
+            break;
+        }
+        l2_tables[dir_index].reset(new PageTable);
+        PageTable &l2 = *l2_tables[dir_index];
+        memory_.get_bytes(reinterpret_cast<uint8_t*> (l2.data()), table_paddr, kPageTableSizeBytes);
+        for (PageTableEntry &pte : l2) {
+            pte &= ~kHardwareBits;
+        }
+    }
+    memory_.set_PMCB(temp_pmcb);
+    if (!tables_ok) {
+        return nullptr;
+    }
+    
+    std::shared_ptr<const TraceProgram> &program_ = programs[name];
+    if (!program_) {
+        program_ = std::make_shared<TraceProgram>(name);
+    }
+    if (program_->ok() && program_->size() != program_size) {
+        return nullptr;  // trace file changed since the snapshot
+    }
+    std::unique_ptr<ProcessTrace> process(new ProcessTrace(
+            name, program_, pc_, memory_, allocator_, out_, err_, directory));
+    process->line_number = line_number_;
+    process->put_done = put_done_;
+    process->demand_paging = demand_paging_;
+    process->reserved.swap(reserved_);
+    process->demand_readonly.swap(demand_readonly_);
+    process->shadow_dir = dir;
+    process->shadow_l2.swap(l2_tables);
+    return process;
+}
 
-        // Get command
-        lineStream >> cmd;
+void ProcessTrace::Reserve(Addr vaddr, Addr num_bytes) {
+    if (num_bytes == 0) {
+        return;
+    }
+    uint64_t start = vaddr;
+    uint64_t end = start + num_bytes;
+    
+    /* Merge with any ranges that overlap or touch the new one, so ranges
+     * stay disjoint and a lookup only has to check one neighbor */
+    std::map<Addr, uint64_t>::iterator range = reserved.upper_bound(vaddr);
+    if (range != reserved.begin()) {
+        std::map<Addr, uint64_t>::iterator prev = range;
+        --prev;
+        if (prev->second >= start) {
+            start = prev->first;
+            end = std::max(end, prev->second);
+            reserved.erase(prev);
+        }
+    }
+    while (range != reserved.end() && range->first <= end) {
+        end = std::max(end, range->second);
+        range = reserved.erase(range);
+    }
+    reserved[start] = end;
+}
 
-        // Get arguments
-        if (cmd != "#") {//remainder of line is not a comment
-            cout << line << std::endl; //print remainder of command line
-            uint32_t arg;
-            while (lineStream >> std::hex >> arg) {
-                cmdArgs.push_back(arg);
+void ProcessTrace::Unreserve(Addr vaddr, Addr num_bytes) {
+    if (num_bytes == 0) {
+        return;
+    }
+    uint64_t start = vaddr;
+    uint64_t end = start + num_bytes;
+    
+    /* Trim the range reaching into the freed one from below, keeping any
+     * part above it */
+    std::map<Addr, uint64_t>::iterator range = reserved.upper_bound(vaddr);
+    if (range != reserved.begin()) {
+        std::map<Addr, uint64_t>::iterator prev = range;
+        --prev;
+        if (prev->second > start) {
+            uint64_t prev_end = prev->second;
+            if (prev->first == start) {
+                reserved.erase(prev);
+            } else {
+                prev->second = start;
+            }
+            if (prev_end > end) {
+                reserved[static_cast<Addr>(end)] = prev_end;
             }
         }
+    }
+    
+    /* Drop ranges starting inside it, keeping the tail of the last one */
+    while (range != reserved.end() && range->first < end) {
+        uint64_t range_end = range->second;
+        range = reserved.erase(range);
+        if (range_end > end) {
+            reserved[static_cast<Addr>(end)] = range_end;
+        }
+    }
+    
+    demand_readonly.erase(demand_readonly.lower_bound(static_cast<Addr>(start >> kPageSizeBits)),
+            demand_readonly.lower_bound(static_cast<Addr>((end + kPageSize - 1) >> kPageSizeBits)));
+}
+
+bool ProcessTrace::IsReserved(Addr vaddr) const {
+    // Find the last reserved range starting at or below vaddr
+    std::map<Addr, uint64_t>::const_iterator range = reserved.upper_bound(vaddr);
+    if (range == reserved.begin()) {
+        return false;
+    }
+    --range;
+    return vaddr < range->second;
+}
+
+bool ProcessTrace::AllocateFrames(uint32_t count, vector<uint32_t> &frames) {
+    if (allocator->Allocate(count, frames)
+            || (pager && pager->Reclaim(count) && allocator->Allocate(count, frames))) {
+        if (stats) stats->counters.frames_allocated += count;
+        return true;
+    }
+    return false;
+}
+
+void ProcessTrace::DeallocateFrames(vector<uint32_t> &frames) {
+    uint32_t free_before = allocator->get_page_frames_free();
+    allocator->Deallocate(frames.size(), frames);
+    if (stats) stats->counters.frames_freed += allocator->get_page_frames_free() - free_before;
+}
+
+bool ProcessTrace::AgePage(Addr vaddr, bool &modified) {
+    Addr dir_index = ((vaddr >> (kPageSizeBits + kPageTableSizeBits)) & kPageTableIndexMask);
+    Addr l2_offset = (vaddr >> kPageSizeBits) & kPageTableIndexMask;
+    Addr pte_paddr = (shadow_dir[dir_index] & 0xFFFFF000) + l2_offset * sizeof(PageTableEntry);
+    
+    /* Accessed/Modified bits are only kept in MMU memory */
+    PageTableEntry pte;
+    memory->get_bytes(reinterpret_cast<uint8_t*> (&pte), pte_paddr, sizeof(pte));
+    if (stats) {
+        ++stats->counters.mmu_calls;
+        stats->counters.page_table_bytes_read += sizeof(pte);
+    }
+    modified = pte & (kPTE_ModifiedMask | kPTE_SoftDirtyMask);
+    if (pte & kPTE_AccessedMask) {
+        pte &= ~kPTE_AccessedMask;
+        memory->put_bytes(pte_paddr, sizeof(pte), reinterpret_cast<uint8_t*> (&pte));
+        allocator->MarkDirty(pte_paddr >> kPageSizeBits);
+        if (stats) {
+            ++stats->counters.mmu_calls;
+            stats->counters.page_table_bytes_written += sizeof(pte);
+        }
         return true;
-    } else if (trace.eof()) {
+    }
+    return false;
+}
+
+void ProcessTrace::SwapOutPage(Addr vaddr, uint32_t slot) {
+    Addr dir_index = ((vaddr >> (kPageSizeBits + kPageTableSizeBits)) & kPageTableIndexMask);
+    Addr l2_offset = (vaddr >> kPageSizeBits) & kPageTableIndexMask;
+    PageTableEntry pte = (*shadow_l2[dir_index])[l2_offset];
+    SetL2Entry(dir_index, l2_offset, (slot << kPageSizeBits) | kPTE_SwappedMask
+            | (pte & (kPTE_WritableMask | kPTE_CopyOnWriteMask)));
+    FlushPageTables();
+}
+
+void ProcessTrace::set_sampling(uint32_t interval, const std::string &report_file_) {
+    sampler.reset(interval > 0 ? new WorkingSetSampler(interval) : nullptr);
+    report_file = report_file_;
+}
+
+void ProcessTrace::set_stats(CommandStats *stats_) {
+    stats = stats_;
+    if (stats) ++stats->counters.frames_allocated;  // page directory
+}
+
+void ProcessTrace::SamplePages(void) {
+    PMCB temp_pmcb;
+    memory->get_PMCB(temp_pmcb);
+    memory->set_PMCB(physical_pmcb);
+    
+    /* One read per L2 table; a table with any bits set is rewritten from
+     * its shadow, which clears them (the shadow never holds them) */
+    PageTable current;
+    for (Addr dir_index = 0; dir_index < kPageTableEntries; ++dir_index) {
+        PageTable *l2 = shadow_l2[dir_index].get();
+        if (!l2) {
+            continue;
+        }
+        Addr table_paddr = shadow_dir[dir_index] & 0xFFFFF000;
+        memory->get_bytes(reinterpret_cast<uint8_t*> (current.data()),
+                table_paddr, kPageTableSizeBytes);
+        if (stats) {
+            ++stats->counters.mmu_calls;
+            stats->counters.page_table_bytes_read += kPageTableSizeBytes;
+        }
+        bool any_set = false;
+        for (Addr i = 0; i < kPageTableEntries; ++i) {
+            if (!(current[i] & kPTE_PresentMask)) {
+                continue;
+            }
+            bool accessed = current[i] & kPTE_AccessedMask;
+            bool modified = current[i] & kPTE_ModifiedMask;
+            sampler->RecordPage((dir_index << (kPageSizeBits + kPageTableSizeBits))
+                    | (i << kPageSizeBits), accessed, modified);
+            if (modified) {
+                (*l2)[i] |= kPTE_SoftDirtyMask;
+            }
+            any_set |= accessed || modified;
+        }
+        if (any_set) {
+            memory->put_bytes(table_paddr, kPageTableSizeBytes,
+                    reinterpret_cast<uint8_t*> (l2->data()));
+            allocator->MarkDirty(table_paddr >> kPageSizeBits);
+            if (stats) {
+                ++stats->counters.mmu_calls;
+                stats->counters.page_table_bytes_written += kPageTableSizeBytes;
+            }
+        }
+    }
+    sampler->EndSample(line_number);
+    
+    memory->set_PMCB(temp_pmcb);
+}
+
+void ProcessTrace::LogModifiedPages(void) {
+    PMCB temp_pmcb;
+    memory->get_PMCB(temp_pmcb);
+    memory->set_PMCB(physical_pmcb);
+    if (!dirty_ptes.empty()) {
+        FlushPageTables();
+    }
+    
+    /* One read per L2 table. Modified bits are moved to the soft-dirty bit
+     * (as SamplePages does) so the next call only sees newer writes; the
+     * rewritten table is itself a changed frame. */
+    PageTable current;
+    for (Addr dir_index = 0; dir_index < kPageTableEntries; ++dir_index) {
+        PageTable *l2 = shadow_l2[dir_index].get();
+        if (!l2) {
+            continue;
+        }
+        Addr table_paddr = shadow_dir[dir_index] & 0xFFFFF000;
+        memory->get_bytes(reinterpret_cast<uint8_t*> (current.data()),
+                table_paddr, kPageTableSizeBytes);
+        bool any_modified = false;
+        for (Addr i = 0; i < kPageTableEntries; ++i) {
+            if ((current[i] & kPTE_PresentMask) && (current[i] & kPTE_ModifiedMask)) {
+                allocator->MarkDirty(current[i] >> kPageSizeBits);
+                current[i] = (current[i] & ~kPTE_ModifiedMask) | kPTE_SoftDirtyMask;
+                (*l2)[i] |= kPTE_SoftDirtyMask;
+                any_modified = true;
+            }
+        }
+        if (any_modified) {
+            memory->put_bytes(table_paddr, kPageTableSizeBytes,
+                    reinterpret_cast<uint8_t*> (current.data()));
+            allocator->MarkDirty(table_paddr >> kPageSizeBits);
+        }
+        if (stats) {
+            stats->counters.mmu_calls += any_modified ? 2 : 1;
+            stats->counters.page_table_bytes_read += kPageTableSizeBytes;
+            if (any_modified) stats->counters.page_table_bytes_written += kPageTableSizeBytes;
+        }
+    }
+    
+    memory->set_PMCB(temp_pmcb);
+}
+
+bool ProcessTrace::SwapInPage(Addr vaddr) {
+    PageTableEntry pte = GetL2Entry(vaddr);
+    if (!(pte & kPTE_SwappedMask)) {
+        return false;  // not evicted
+    }
+    
+    /* Switch to physical mode; the faulting operation is abandoned and
+     * reissued by the caller, so clear its state before switching back */
+    PMCB temp_pmcb;
+    memory->get_PMCB(temp_pmcb);
+    temp_pmcb.operation_state = PMCB::NONE;
+    memory->set_PMCB(physical_pmcb);
+    
+    Addr dir_index = ((vaddr >> (kPageSizeBits + kPageTableSizeBits)) & kPageTableIndexMask);
+    Addr l2_offset = (vaddr >> kPageSizeBits) & kPageTableIndexMask;
+    uint32_t slot = pte >> kPageSizeBits;
+    vector<uint32_t> frames;
+    if (!AllocateFrames(1, frames)) {
+        memory->set_PMCB(temp_pmcb);
+        return false;  // out of memory, report the fault
+    }
+    if (!pager->SwapIn(slot, frames[0])) {
+        allocator->Deallocate(1, frames);
+        memory->set_PMCB(temp_pmcb);
         return false;
-    } else {
-        cerr << "ERROR: getline failed on trace file: " << file_name
-                << "at line " << line_number << "\n";
-        exit(2);
     }
+    
+    /* The frame is private, so a copy-on-write page is simply writable. The
+     * slot stays referenced as a clean copy until the page is modified. */
+    PageTableEntry new_pte = (frames[0] * kPageSize) | kPTE_PresentMask;
+    if (pte & (kPTE_WritableMask | kPTE_CopyOnWriteMask)) {
+        new_pte |= kPTE_WritableMask;
+    }
+    SetL2Entry(dir_index, l2_offset, new_pte);
+    FlushPageTables();
+    pager->Register(frames[0], this, vaddr & ~(kPageSize - 1), slot);
+    if (stats) ++stats->counters.swap_ins;
+    
+    memory->set_PMCB(temp_pmcb);
+    return true;
+}
+
+bool ProcessTrace::BreakCopyOnWrite(Addr vaddr) {
+    PageTableEntry pte = GetL2Entry(vaddr);
+    if (!(pte & kPTE_PresentMask) || !(pte & kPTE_CopyOnWriteMask)) {
+        return false;  // a genuine fault
+    }
+    
+    /* Switch to physical mode; the faulting operation is abandoned and
+     * reissued by the caller, so clear its state before switching back */
+    PMCB temp_pmcb;
+    memory->get_PMCB(temp_pmcb);
+    temp_pmcb.operation_state = PMCB::NONE;
+    memory->set_PMCB(physical_pmcb);
+    
+    Addr dir_index = ((vaddr >> (kPageSizeBits + kPageTableSizeBits)) & kPageTableIndexMask);
+    Addr l2_offset = (vaddr >> kPageSizeBits) & kPageTableIndexMask;
+    uint32_t frame = pte >> kPageSizeBits;
+    PageTableEntry new_pte = (pte & ~kPTE_CopyOnWriteMask) | kPTE_WritableMask;
+    
+    /* Still shared: copy into a frame of our own and drop our reference
+     * to the old one. Otherwise the other owners are gone and the frame
+     * can simply be made writable. */
+    if (allocator->IsShared(frame)) {
+        vector<uint32_t> frames;
+        if (!AllocateFrames(1, frames)) {
+            memory->set_PMCB(temp_pmcb);
+            return false;  // out of memory, report the fault
+        }
+        cow_page.resize(kPageSize);
+        memory->get_bytes(cow_page.data(), frame * kPageSize, kPageSize);
+        memory->put_bytes(frames[0] * kPageSize, kPageSize, cow_page.data());
+        allocator->MarkDirty(frames[0]);
+        new_pte = (frames[0] * kPageSize) | (new_pte & (kPageSize - 1));
+        
+        if (pager) pager->Unregister(frame, this);
+        vector<uint32_t> old_frame(1, frame);
+        DeallocateFrames(old_frame);
+        if (stats) stats->counters.mmu_calls += 2;
+    }
+    SetL2Entry(dir_index, l2_offset, new_pte);
+    FlushPageTables();
+    if (pager) pager->Register(new_pte >> kPageSizeBits, this, vaddr & ~(kPageSize - 1));
+    if (stats) ++stats->counters.cow_breaks;
+    
+    memory->set_PMCB(temp_pmcb);
+    return true;
+}
+
+bool ProcessTrace::MapDemandPage(Addr vaddr) {
+    if (!demand_paging || !IsReserved(vaddr)) {
+        return false;  // a genuine fault
+    }
+    
+    /* Switch to physical mode; the faulting operation is abandoned and
+     * reissued by the caller, so clear its state before switching back */
+    PMCB temp_pmcb;
+    memory->get_PMCB(temp_pmcb);
+    temp_pmcb.operation_state = PMCB::NONE;
+    memory->set_PMCB(physical_pmcb);
+    
+    Addr dir_index = ((vaddr >> (kPageSizeBits + kPageTableSizeBits)) & kPageTableIndexMask);
+    Addr l2_offset = (vaddr >> kPageSizeBits) & kPageTableIndexMask;
+    
+    /* Need a frame for the page, plus one for its L2 table if missing */
+    bool pageTable_exists = shadow_dir[dir_index] & kPTE_PresentMask;
+    vector<uint32_t> frames;
+    if (!AllocateFrames(pageTable_exists ? 1 : 2, frames)) {
+        memory->set_PMCB(temp_pmcb);
+        return false;  // out of memory, report the fault
+    }
+    if (!pageTable_exists) {
+        SetDirEntry(dir_index, (frames[1] * kPageSize) | kPTE_PresentMask | kPTE_WritableMask);
+    }
+    
+    PageTableEntry pte = (frames[0] * kPageSize) | kPTE_PresentMask;
+    if (demand_readonly.count(vaddr >> kPageSizeBits) == 0) {
+        pte |= kPTE_WritableMask;
+    }
+    SetL2Entry(dir_index, l2_offset, pte);
+    FlushPageTables();
+    if (pager) pager->Register(frames[0], this, vaddr & ~(kPageSize - 1));
+    if (stats) ++stats->counters.demand_maps;
+    
+    memory->set_PMCB(temp_pmcb);
+    return true;
+}
+
+PageTableEntry ProcessTrace::GetL2Entry(Addr vaddr) const {
+    Addr dir_index = ((vaddr >> (kPageSizeBits + kPageTableSizeBits)) & kPageTableIndexMask);
+    Addr l2_offset = (vaddr >> kPageSizeBits) & kPageTableIndexMask;
+    const PageTable *l2 = shadow_l2[dir_index].get();
+    return l2 ? (*l2)[l2_offset] : 0;
+}
+
+void ProcessTrace::SetDirEntry(Addr dir_index, PageTableEntry entry) {
+    shadow_dir[dir_index] = entry;
+    DirtyRun run = { static_cast<Addr>(page_directory_base + dir_index*sizeof(PageTableEntry)),
+                     &shadow_dir[dir_index], 1 };
+    dirty_ptes.push_back(run);
+    
+    /* Newly allocated L2 tables come from the allocator zeroed */
+    if ((entry & kPTE_PresentMask) && !shadow_l2[dir_index]) {
+        shadow_l2[dir_index].reset(new PageTable);
+        shadow_l2[dir_index]->fill(0);
+    }
+}
+
+void ProcessTrace::SetL2Entry(Addr dir_index, Addr l2_offset, PageTableEntry entry) {
+    (*shadow_l2[dir_index])[l2_offset] = entry;
+    MarkL2Dirty(dir_index, l2_offset, 1);
+}
+
+void ProcessTrace::MarkL2Dirty(Addr dir_index, Addr l2_first, Addr count) {
+    DirtyRun run = { static_cast<Addr>((shadow_dir[dir_index] & 0xFFFFF000) + l2_first*sizeof(PageTableEntry)),
+                     &(*shadow_l2[dir_index])[l2_first], count };
+    dirty_ptes.push_back(run);
+}
+
+void ProcessTrace::ForEachL2Run(Addr vaddr, uint32_t num_pages,
+        const L2RunVisitor &visit) const {
+    uint64_t page = vaddr >> kPageSizeBits;
+    uint64_t end_page = std::min(page + num_pages, uint64_t(1) << (32 - kPageSizeBits));
+    while (page < end_page) {
+        Addr dir_index = (page >> kPageTableSizeBits) & kPageTableIndexMask;
+        Addr l2_first = page & kPageTableIndexMask;
+        Addr count = std::min<uint64_t>(end_page - page, kPageTableEntries - l2_first);
+        visit(dir_index, l2_first, count);
+        page += count;
+    }
+}
+
+void ProcessTrace::ForEachSpan(Addr vaddr, Addr count,
+        const SpanVisitor &visit) const {
+    Addr offset = 0;
+    while (offset < count) {
+        Addr chunk_vaddr = vaddr + offset;
+        Addr chunk_count = std::min(count - offset,
+                kPageSize - (chunk_vaddr & (kPageSize - 1)));
+        visit(chunk_vaddr, chunk_count, offset);
+        offset += chunk_count;
+    }
+}
+
+void ProcessTrace::FlushPageTables(void) {
+    PageTable current;
+    for (const DirtyRun &dirty : dirty_ptes) {
+        /* The MMU sets Accessed/Modified bits in its own copy only; keep
+         * them as long as an entry still maps the same frame. One read and
+         * one write covers the whole run. */
+        Addr num_bytes = dirty.count * sizeof(PageTableEntry);
+        memory->get_bytes(reinterpret_cast<uint8_t*> (current.data()),
+                dirty.paddr, num_bytes);
+        if (stats) {
+            stats->counters.mmu_calls += 2;
+            stats->counters.page_table_bytes_read += num_bytes;
+            stats->counters.page_table_bytes_written += num_bytes;
+        }
+        for (uint32_t i = 0; i < dirty.count; ++i) {
+            PageTableEntry entry = dirty.entries[i];
+            if ((current[i] & entry & kPTE_PresentMask)
+                    && (current[i] & 0xFFFFF000) == (entry & 0xFFFFF000)) {
+                entry |= current[i] & (kPTE_AccessedMask | kPTE_ModifiedMask);
+            }
+            current[i] = entry;
+        }
+        memory->put_bytes(dirty.paddr, num_bytes,
+                reinterpret_cast<uint8_t*> (current.data()));
+        allocator->MarkDirty(dirty.paddr >> kPageSizeBits);
+    }
+    dirty_ptes.clear();
 }
 
 /*
@@ -132,249 +935,373 @@ bool ProcessTrace::ParseCommand(
  * 1st and 2nd level page tables when initially allocated. All newly-allocated
  * memory must be initialized to 0
  */
-void ProcessTrace::CmdAlloc(const string &line,
-        const string &cmd,
-        const vector<uint32_t> &cmdArgs) {
-    Addr vaddr = cmdArgs.at(0);
-    Addr num_bytes = cmdArgs.at(1);
+void ProcessTrace::CmdAlloc(const Instruction &ins) {
+    Addr vaddr = ins.args[0];
+    Addr num_bytes = ins.args[1];
     if(num_bytes % 0x1000 != 0){
-        cerr << "Allocation not a multiple of page frame size" << std::endl;
-        exit(3);
+        Abort("Allocation not a multiple of page frame size\n", 3);
     }
+    /* Demand paging: just record the range, frames are allocated and
+     * mapped by MapDemandPage on first touch */
+    if (demand_paging) {
+        Reserve(vaddr, num_bytes);
+        return;
+    }
+    
     /* Switch to physical mode */
     PMCB temp_pmcb;
     memory->get_PMCB(temp_pmcb);
     memory->set_PMCB(physical_pmcb);
     
-    uint32_t numFrames = num_bytes / 0x1000;
-    uint32_t numPTs = 0;
-    uint32_t count = 0;
+    uint32_t numPages = num_bytes / kPageSize;
     
-    /* Verify that we have enough free page frames to accommodate the entire 
-     * alloc command */
-    PageTable dir;
-    Addr dir_base = physical_pmcb.page_table_base;// Get our page directory (1st level page table)
-    /* Now read the page directory */
-    try {
-        memory->get_bytes(reinterpret_cast<uint8_t*> (&dir), dir_base, kPageTableSizeBytes);
-    } catch (PageFaultException e) {
-        cout << "Page fault exception while reading page directory.\n";
+    /* Without a pager the whole command is one batch, and if it fails the
+     * pages just stay unmapped (later accesses fault). With one, each L2
+     * run is a batch, so pages mapped by earlier batches can be evicted to
+     * make room for later ones; a run too large to be resident at once is
+     * mapped a page at a time, and running out is reported. */
+    bool mapped = true;
+    Addr failed_vaddr = vaddr;
+    if (!pager) {
+        MapNewPages(vaddr, numPages);
+    } else {
+        ForEachL2Run(vaddr, numPages, [&](Addr dir_index, Addr l2_first, Addr run_length) {
+            Addr run_vaddr = (dir_index << (kPageSizeBits + kPageTableSizeBits)) | (l2_first << kPageSizeBits);
+            if (!mapped || MapNewPages(run_vaddr, run_length)) {
+                return;
+            }
+            for (Addr i = 0; i < run_length && mapped; ++i) {
+                failed_vaddr = run_vaddr + i * kPageSize;
+                mapped = MapNewPages(failed_vaddr, 1);
+            }
+        });
     }
-    
-    /* Count how many page tables we will need to allocate (if any) 
-     * It's possible that we have to both allocate a page table and then
-     * the page in that page table, requiring us to allocate extra frames */
-    uint32_t tempVAddr = vaddr;
-    while(count++ < numFrames) {
-        Addr dir_index = ((tempVAddr >> (kPageSizeBits + kPageTableSizeBits)) & kPageTableIndexMask);
-        bool pageTable_exists = dir[dir_index] & kPTE_PresentMask; 
-        if(pageTable_exists){
-            numPTs++;
-        }
-        tempVAddr += count*kPageSize;
+    if (!mapped) {
+        output.Append("alloc error: out of page frames at address ");
+        output.AppendHex(failed_vaddr);
+        output.Append('\n');
     }
     
-    count = 0;
-    numFrames += numPTs;
+    /* Switch back to virtual mode */
+    memory->set_PMCB(temp_pmcb);       
+}
+
+bool ProcessTrace::MapNewPages(Addr vaddr, uint32_t num_pages) {
+    /* Count the frames needed for the whole range up front: one for each
+     * page not already mapped, plus one for each missing L2 page table.
+     * The shadow tables answer this without touching MMU memory. */
+    uint32_t numFrames = 0;
+    ForEachL2Run(vaddr, num_pages, [&](Addr dir_index, Addr l2_first, Addr count) {
+        const PageTable *l2 = shadow_l2[dir_index].get();
+        if (!l2) {
+            numFrames += 1 + count; // new L2 table and all of its pages
+        } else {
+            for (Addr i = l2_first; i < l2_first + count; ++i) {
+                if (!((*l2)[i] & (kPTE_PresentMask | kPTE_SwappedMask))) ++numFrames;
+            }
+        }
+    });
     
-    if(allocator->get_page_frames_free() >= numFrames){
+    /* Take every frame the range needs in a single call, L2 tables
+     * included; frames come back already zeroed, so new L2 tables need no
+     * further initialization. With the buddy allocator, try for one
+     * contiguous run first so a new L2 table lands right next to the pages
+     * it maps. */
+    vector<uint32_t> frames;
+    bool contiguous = numFrames > 0
+            && allocator->get_mode() == PageFrameAllocator::kBuddy
+            && allocator->AllocateContiguous(numFrames, frames);
+    if (contiguous && stats) stats->counters.frames_allocated += numFrames;
+    bool allocated = contiguous || (numFrames > 0 && AllocateFrames(numFrames, frames));
+    if (allocated) {
+        vector<uint32_t>::const_iterator next_frame = frames.begin();
         
-        /* While we have page frames to allocate */
-        while(count++ < numFrames){
-            Addr frame_pAddr = allocator->get_free_list_head() * kPageSize;
-            Addr dir_index = ((vaddr >> (kPageSizeBits + kPageTableSizeBits)) & kPageTableIndexMask);
-            Addr l2_offset = (vaddr >> kPageSizeBits) & kPageTableIndexMask;
+        ForEachL2Run(vaddr, num_pages, [&](Addr dir_index, Addr l2_first, Addr count) {
+            if (!(shadow_dir[dir_index] & kPTE_PresentMask)) {
+                SetDirEntry(dir_index, (*next_frame++ * kPageSize) | kPTE_PresentMask | kPTE_WritableMask);
+            }
             
-            /* Find if a page table at this vaddr already exists by checking
-             * its present bit */
-            bool pageTable_exists = dir[dir_index] & kPTE_PresentMask;             
-
-            /* If we have room to allocate */
-            if(allocator->Allocate(1)){
-            //allocator->Allocate(1);
-                /* Compute some offsets */
-                PageTable l2_temp;
-                
-                /* If we don't already have a page table at this addr, allocate
-                 * another frame. */
-                if(!pageTable_exists){
-                    Addr ptAddr = allocator->get_free_list_head() *kPageSize;
-                    /* Check that we can allocate another frame */
-                    if(allocator->Allocate(1)){                       
-                        dir[dir_index] = ptAddr | kPTE_PresentMask | kPTE_WritableMask;
-                        memory->put_bytes(dir_base, kPageTableSizeBytes, 
-                                reinterpret_cast<uint8_t*>(&dir));
+            /* Map a fresh frame to each page not already present, then
+             * queue the run for write-back as a single update */
+            PageTable &l2 = *shadow_l2[dir_index];
+            for (Addr i = l2_first; i < l2_first + count; ++i) {
+                if (!(l2[i] & (kPTE_PresentMask | kPTE_SwappedMask))) {
+                    l2[i] = (*next_frame++ * kPageSize) | kPTE_PresentMask | kPTE_WritableMask;
+                    if (pager) {
+                        pager->Register(l2[i] >> kPageSizeBits, this,
+                                (dir_index << (kPageSizeBits + kPageTableSizeBits)) | (i << kPageSizeBits));
                     }
-                    memory->put_bytes(ptAddr, kPageTableSizeBytes,
-                            reinterpret_cast<uint8_t*>(&l2_temp));                    
-                }
-                
-                /* Specific (L3) page inside of our L2 page table */
-                Addr l2_pAddr = (dir[dir_index] & 0xFFFFF000);
-                try {
-                    /* If we DO have a page table, read that page table
-                     * into l2_temp */
-                    memory->get_bytes(reinterpret_cast<uint8_t*> (&l2_temp), 
-                            l2_pAddr, kPageTableSizeBytes);
-                } catch (PageFaultException e) {
-                    cout << "Page fault exception while reading L2 PT.\n";
-                }
-                
-                /* Determine if page in L2 table maps to something */
-                bool pageEntry_exists = l2_temp[l2_offset] & kPTE_PresentMask;
-                if(!pageEntry_exists){
-                    l2_temp[l2_offset] = frame_pAddr | kPTE_PresentMask | kPTE_WritableMask;
-                    memory->put_bytes(l2_pAddr, kPageTableSizeBytes,
-                            reinterpret_cast<uint8_t*>(&l2_temp));       
                 }
             }
-            
-            /* Move to the next vaddr */
-            vaddr += count*kPageSize;
-        }    
+            MarkL2Dirty(dir_index, l2_first, count);
+        });
+        
+        /* Write back just the entries that changed */
+        FlushPageTables();
     }
-    /* Switch back to virtual mode */
-    memory->set_PMCB(temp_pmcb);       
+    return allocated || numFrames == 0;
 }
 
-void ProcessTrace::CmdCompare(const string &line,
-        const string &cmd,
-        const vector<uint32_t> &cmdArgs) {
-    uint32_t addr = cmdArgs.at(0);
+void ProcessTrace::CmdCompare(const Instruction &ins) {
+    uint32_t addr = ins.args[0];
 
+    // Read all bytes first, one MMU call per page-resident chunk
+    size_t num_bytes = ins.payload_count;
+    io_buffer.resize(num_bytes);
+    ForEachSpan(addr, num_bytes, [&](Addr vaddr, Addr count, Addr offset) {
+        GetBytes(&io_buffer[offset], vaddr, count);
+    });
+    
+    // Fast path: expected values are all bytes and everything matches
+    if (ins.form == BinaryTrace::kBytes
+            && memcmp(io_buffer.data(), program->Bytes(ins), num_bytes) == 0) {
+        return;
+    }
+    
     // Compare specified byte values
-    size_t num_bytes = cmdArgs.size() - 1;
-    uint8_t buffer[num_bytes];
-    memory->get_bytes(buffer, addr, num_bytes);
-    for (int i = 1; i < cmdArgs.size(); ++i) {
-        if (buffer[i - 1] != cmdArgs.at(i)) {
-            cout << "compare error at address " << std::hex << addr
-                    << ", expected " << static_cast<uint32_t> (cmdArgs.at(i))
-                    << ", actual is " << static_cast<uint32_t> (buffer[i - 1]) << "\n";
+    for (size_t i = 0; i < num_bytes; ++i) {
+        uint32_t expected = ins.form == BinaryTrace::kBytes
+                ? program->Bytes(ins)[i] : program->Words(ins)[i];
+        if (io_buffer[i] != expected) {
+            output.Append("compare error at address ");
+            output.AppendHex(addr);
+            output.Append(", expected ");
+            output.AppendHex(expected);
+            output.Append(", actual is ");
+            output.AppendHex(io_buffer[i]);
+            output.Append('\n');
         }
         ++addr;
     }
 }
 
-void ProcessTrace::CmdPut(const string &line,
-        const string &cmd,
-        const vector<uint32_t> &cmdArgs) {
+void ProcessTrace::CmdPut(const Instruction &ins) {
     // Put multiple bytes starting at specified address
-    uint32_t addr = cmdArgs.at(0);
-    size_t num_bytes = cmdArgs.size() - 1;
-    uint8_t buffer[num_bytes];
-    for (int i = 1; i < cmdArgs.size(); ++i) {
-        buffer[i - 1] = cmdArgs.at(i);
-    }
-    memory->put_bytes(addr, num_bytes, buffer);
+    uint32_t addr = ins.args[0];
+    size_t num_bytes = ins.payload_count;
+    io_buffer.assign(program->Bytes(ins), program->Bytes(ins) + num_bytes);
+    ForEachSpan(addr, num_bytes, [&](Addr vaddr, Addr count, Addr offset) {
+        PutBytes(vaddr, count, &io_buffer[offset]);
+    });
+    put_done = true;
 }
 
-void ProcessTrace::CmdCopy(const string &line,
-        const string &cmd,
-        const vector<uint32_t> &cmdArgs) {
+void ProcessTrace::CmdCopy(const Instruction &ins) {
     // Copy specified number of bytes to destination from source
-    Addr dst = cmdArgs.at(0);
-    Addr src = cmdArgs.at(1);
-    Addr num_bytes = cmdArgs.at(2);
-    uint8_t buffer[num_bytes];
-    memory->get_bytes(buffer, src, num_bytes);
-    memory->put_bytes(dst, num_bytes, buffer);
+    Addr dst = ins.args[0];
+    Addr src = ins.args[1];
+    Addr num_bytes = ins.args[2];
+    
+    /* Read the whole source before writing anything, so a fault in the
+     * source leaves the destination untouched */
+    io_buffer.resize(num_bytes);
+    ForEachSpan(src, num_bytes, [&](Addr vaddr, Addr count, Addr offset) {
+        GetBytes(&io_buffer[offset], vaddr, count);
+    });
+    ForEachSpan(dst, num_bytes, [&](Addr vaddr, Addr count, Addr offset) {
+        PutBytes(vaddr, count, &io_buffer[offset]);
+    });
 }
 
-void ProcessTrace::CmdFill(const string &line,
-        const string &cmd,
-        const vector<uint32_t> &cmdArgs) {
+void ProcessTrace::CmdFill(const Instruction &ins) {
     // Fill a sequence of bytes with the specified value
-    Addr addr = cmdArgs.at(0);
-    Addr num_bytes = cmdArgs.at(1);
-    uint8_t val = cmdArgs.at(2);
-    for (int i = 0; i < num_bytes; ++i) {
-        memory->put_byte(addr++, &val);
-    }
+    Addr addr = ins.args[0];
+    Addr num_bytes = ins.args[1];
+    uint8_t val = ins.args[2];
+    
+    // One page of the value serves every chunk
+    io_buffer.assign(std::min<Addr>(num_bytes, kPageSize), val);
+    ForEachSpan(addr, num_bytes, [&](Addr vaddr, Addr count, Addr /*offset*/) {
+        PutBytes(vaddr, count, io_buffer.data());
+    });
 }
 
-void ProcessTrace::CmdDump(const string &line,
-        const string &cmd,
-        const vector<uint32_t> &cmdArgs) {
-    uint32_t addr = cmdArgs.at(0);
-    uint32_t count = cmdArgs.at(1);
+void ProcessTrace::CmdDump(const Instruction &ins) {
+    uint32_t addr = ins.args[0];
+    uint32_t count = ins.args[1];
 
     // Output the address
-    cout << std::hex << addr;
+    output.AppendHex(addr);
 
-    // Output the specified number of bytes starting at the address
-    for (int i = 0; i < count; ++i) {
-        if ((i % 16) == 0) { // line break every 16 bytes
-            cout << "\n";
+    // Output the specified number of bytes starting at the address; each
+    // chunk is printed as soon as it is read, so a fault leaves the bytes
+    // before the faulting address on the output
+    io_buffer.resize(std::min<Addr>(count, kPageSize));
+    ForEachSpan(addr, count, [&](Addr vaddr, Addr chunk_count, Addr offset) {
+        GetBytes(io_buffer.data(), vaddr, chunk_count);
+        
+        // Write whole rows at a time, with a line break every 16 bytes
+        Addr i = 0;
+        while (i < chunk_count) {
+            Addr row_pos = (offset + i) % 16;
+            if (row_pos == 0) {
+                output.Append('\n');
+            }
+            Addr row_count = std::min(chunk_count - i, 16 - row_pos);
+            output.AppendHexBytes(&io_buffer[i], row_count);
+            i += row_count;
         }
-        uint8_t byte_val;
-        memory->get_byte(&byte_val, addr++);
-        cout << " " << std::setfill('0') << std::setw(2)
-                << static_cast<uint32_t> (byte_val);
-    }
-    cout << "\n";
+    });
+    output.Append('\n');
 }
 
-void ProcessTrace::CmdWritable(const std::string& line,
-        const std::string& cmd,
-        const std::vector<uint32_t>& cmdArgs) {
+void ProcessTrace::CmdWritable(const Instruction &ins) {
     //Command Format:
     //writable vaddr size status
     
-    uint32_t vaddr = cmdArgs.at(0);
-    uint32_t count = cmdArgs.at(1);
-    bool status = cmdArgs.at(2);
+    uint32_t vaddr = ins.args[0];
+    uint32_t count = ins.args[1];
+    bool status = ins.args[2];
     
-    /* Set to physical -- we're modifying physical page table entries */
-    PMCB temp_pmcb;
-    memory->get_PMCB(temp_pmcb);
-    memory->set_PMCB(physical_pmcb);
+    uint32_t num_frames = count/kPageSize;
     
-    PageTable dir;
-    Addr dir_base = physical_pmcb.page_table_base;// Get our page directory (1st level page table)
-    /* Now read the page directory */
-    try {
-        memory->get_bytes(reinterpret_cast<uint8_t*> (&dir), dir_base, kPageTableSizeBytes);
-    } catch (PageFaultException e) {
-        cout << "Page fault exception while reading page directory.\n";
+    /* Edit the shadow L2 entries one table at a time; only Present pages
+     * are changed, and each table's changes are written back as one run */
+    ForEachL2Run(vaddr, num_frames, [&](Addr dir_index, Addr l2_first, Addr run_length) {
+        PageTable *l2 = shadow_l2[dir_index].get();
+        Addr changed_first = kPageTableEntries;
+        Addr changed_end = 0;
+        for (Addr i = l2_first; i < l2_first + run_length; ++i) {
+            PageTableEntry pte = l2 ? (*l2)[i] : 0;
+            
+            /* Determine if page in L2 table maps to something */
+            if (pte & kPTE_PresentMask) {
+                /* A page whose frame is shared only becomes copy-on-write;
+                 * it gets the Writable bit once it has been copied */
+                PageTableEntry new_pte;
+                if (!status) {
+                    new_pte = pte & ~(kPTE_WritableMask | kPTE_CopyOnWriteMask);
+                } else if ((pte & (kPTE_WritableMask | kPTE_CopyOnWriteMask)) == 0
+                        && allocator->IsShared(pte >> kPageSizeBits)) {
+                    new_pte = pte | kPTE_CopyOnWriteMask;
+                } else if (pte & kPTE_CopyOnWriteMask) {
+                    new_pte = pte;
+                } else {
+                    new_pte = pte | kPTE_WritableMask;
+                }
+                if (new_pte != pte) {
+                    (*l2)[i] = new_pte;
+                    changed_first = std::min(changed_first, i);
+                    changed_end = i + 1;
+                }
+            } else if (pte & kPTE_SwappedMask) {
+                /* Evicted; it comes back in a private frame, so the status
+                 * applies as is */
+                PageTableEntry new_pte = (pte & ~(kPTE_WritableMask | kPTE_CopyOnWriteMask))
+                        | (status ? kPTE_WritableMask : 0);
+                if (new_pte != pte) {
+                    (*l2)[i] = new_pte;
+                    changed_first = std::min(changed_first, i);
+                    changed_end = i + 1;
+                }
+            } else if (demand_paging) {
+                Addr page_vaddr = (dir_index << (kPageSizeBits + kPageTableSizeBits)) | (i << kPageSizeBits);
+                if (IsReserved(page_vaddr)) {
+                    /* Not backed yet; remember the status for when it is mapped */
+                    if (!status) {
+                        demand_readonly.insert(page_vaddr >> kPageSizeBits);
+                    } else {
+                        demand_readonly.erase(page_vaddr >> kPageSizeBits);
+                    }
+                }
+            }
+        }
+        if (changed_first < changed_end) {
+            MarkL2Dirty(dir_index, changed_first, changed_end - changed_first);
+        }
+    });
+    
+    /* Set to physical -- we're writing physical page table entries */
+    if (!dirty_ptes.empty()) {
+        PMCB temp_pmcb;
+        memory->get_PMCB(temp_pmcb);
+        memory->set_PMCB(physical_pmcb);
+        FlushPageTables();
+        memory->set_PMCB(temp_pmcb);
     }
-    Addr l2_offset;
-    Addr dir_index = ((vaddr >> (kPageSizeBits + kPageTableSizeBits)) & kPageTableIndexMask);
+}
 
-    PageTable l2_temp; 
-    Addr l2_pAddr = (dir[dir_index] & 0xFFFFF000);
-    try {
-        /* If we DO have a page table, read that page table
-         * into l2_temp */
-        memory->get_bytes(reinterpret_cast<uint8_t*> (&l2_temp),
-                l2_pAddr, kPageTableSizeBytes);
-    } catch (PageFaultException e) {
-        cout << "Page fault exception while reading L2 PT.\n";
+/*
+ * Release virtual memory for size bytes, starting at virtual address vaddr.
+ * Like alloc, size must be a multiple of the page size. Pages in the range
+ * are unmapped and their frames returned to the allocator, along with any
+ * L2 table left with no pages mapped. Pages in the range that were never
+ * allocated are ignored.
+ */
+void ProcessTrace::CmdFree(const Instruction &ins) {
+    Addr vaddr = ins.args[0];
+    Addr num_bytes = ins.args[1];
+    if (num_bytes % kPageSize != 0) {
+        Abort("Free not a multiple of page frame size\n", 3);
+    }
+    if (demand_paging) {
+        Unreserve(vaddr, num_bytes);
     }
     
-    uint32_t num_frames = count/kPageSize;
-    uint32_t i = 0;
-    
-    while(i++ < num_frames){
-        l2_offset = (vaddr >> kPageSizeBits) & kPageTableIndexMask;
-        
-        /* Determine if page in L2 table maps to something */
-        bool pageEntry_exists = l2_temp[l2_offset] & kPTE_PresentMask;
-        if (pageEntry_exists) {
-            if(!status){
-                l2_temp[l2_offset] &= ~(kPTE_WritableMask);
-            } else if (status){
-                l2_temp[l2_offset] |= kPTE_WritableMask;
+    /* Clear the shadow L2 entries, collecting their frames; each table's
+     * changes are written back as one run */
+    vector<uint32_t> frames;
+    vector<Addr> touched_tables;
+    ForEachL2Run(vaddr, num_bytes / kPageSize, [&](Addr dir_index, Addr l2_first, Addr count) {
+        PageTable *l2 = shadow_l2[dir_index].get();
+        if (!l2) {
+            return;
+        }
+        Addr changed_first = kPageTableEntries;
+        Addr changed_end = 0;
+        for (Addr i = l2_first; i < l2_first + count; ++i) {
+            PageTableEntry pte = (*l2)[i];
+            if (pte & kPTE_PresentMask) {
+                frames.push_back(pte >> kPageSizeBits);
+                if (pager) pager->Unregister(pte >> kPageSizeBits, this);
+            } else if (pte & kPTE_SwappedMask) {
+                pager->ReleaseSlot(pte >> kPageSizeBits);
+            } else {
+                continue;
             }
-            
-            memory->put_bytes(l2_pAddr, kPageTableSizeBytes,
-                    reinterpret_cast<uint8_t*> (&l2_temp));
+            (*l2)[i] = 0;
+            changed_first = std::min(changed_first, i);
+            changed_end = i + 1;
+        }
+        if (changed_first < changed_end) {
+            MarkL2Dirty(dir_index, changed_first, changed_end - changed_first);
+            touched_tables.push_back(dir_index);
+        }
+    });
+    if (touched_tables.empty()) {
+        return;
+    }
+    
+    /* Set to physical -- we're writing physical page table entries */
+    PMCB temp_pmcb;
+    memory->get_PMCB(temp_pmcb);
+    memory->set_PMCB(physical_pmcb);
+    FlushPageTables();
+    
+    /* Release L2 tables that no longer map anything */
+    for (Addr dir_index : touched_tables) {
+        const PageTable &l2 = *shadow_l2[dir_index];
+        if (std::all_of(l2.begin(), l2.end(), [](PageTableEntry pte) { return pte == 0; })) {
+            frames.push_back(shadow_dir[dir_index] >> kPageSizeBits);
+            SetDirEntry(dir_index, 0);
+            shadow_l2[dir_index].reset();
         }
-        vaddr += (i*kPageSize);
     }
-    memory->set_PMCB(temp_pmcb);    
+    FlushPageTables();
+    
+    DeallocateFrames(frames);
+    memory->set_PMCB(temp_pmcb);
 }
 
-void ProcessTrace::CmdComment(const std::string& line) {
-    cout << line << std::endl;
+/*
+ * Clone this process: the child shares all of its memory copy-on-write and
+ * runs the rest of the trace after this command, alongside the parent
+ * (see Fork). Nothing happens if there is not enough memory for the
+ * child's page tables.
+ */
+void ProcessTrace::CmdFork(const Instruction &/*ins*/) {
+    std::unique_ptr<ProcessTrace> child = Fork();
+    if (child) {
+        children.push_back(std::move(child));
+    }
 }
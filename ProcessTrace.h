@@ -119,23 +119,57 @@
 #define PROCESSTRACE_H
 
 #include <MMU.h>
+#include "CommandStats.h"
+#include "OutputSink.h"
 #include "PageFrameAllocator.h"
+#include "Pager.h"
+#include "TraceProgram.h"
+#include "WorkingSetSampler.h"
 
-#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <set>
+#include <stdexcept>
 #include <string>
 #include <vector>
 
+/**
+ * TraceError - thrown when a trace cannot be processed further (file can't
+ *   be read, invalid command, bad alloc size). The error message has
+ *   already been written to the process's error stream; the exception
+ *   carries the exit status the program should end with.
+ */
+class TraceError : public std::runtime_error {
+public:
+  TraceError(const std::string &message, int exit_status_)
+  : std::runtime_error(message), exit_status(exit_status_) {}
+  
+  int get_exit_status(void) const { return exit_status; }
+  
+private:
+  int exit_status;
+};
+
 class ProcessTrace {
 public:
   /**
-   * Constructor - open trace file, initialize processing
+   * Constructor - open trace file, initialize processing. The file may be a
+   *   text trace or a compiled trace (see BinaryTrace.h); either way it is
+   *   decoded up front into a TraceProgram, which is then executed.
    * 
    * @param file_name_ source of trace commands
+   * @param out_ stream receiving the trace output
+   * @param err_ stream receiving error messages
+   * @throws TraceError if the trace can't be opened or has no page directory
    */
-  ProcessTrace(std::string file_name_, mem::MMU &memory_, PageFrameAllocator &allocator_);
+  ProcessTrace(std::string file_name_, mem::MMU &memory_, PageFrameAllocator &allocator_,
+               std::ostream &out_ = std::cout, std::ostream &err_ = std::cerr);
   
   /**
-   * Destructor - close trace file, clean up processing
+   * Destructor - close trace file, and return every frame the process owns
+   *   (its pages, L2 tables and page directory) to the allocator
    */
   virtual ~ProcessTrace(void);
 
@@ -154,59 +188,437 @@ public:
    */
   void Execute(void);
   
+  /**
+   * Step - read and process the next command from the trace file. The
+   *   process must be switched in (its PMCB loaded in the MMU).
+   * 
+   * @return true if a command was processed, false at end of trace
+   * @throws TraceError if the trace can't be processed further
+   */
+  bool Step(void);
+  
+  /**
+   * SwitchIn - context switch to this process: load its PMCB (and so its
+   *   page directory) into the MMU
+   */
+  void SwitchIn(void);
+  
+  /**
+   * SwitchOut - context switch away from this process: save its PMCB and
+   *   write out its buffered output
+   */
+  void SwitchOut(void);
+  
+  // Access to private values
+  const std::string &get_file_name(void) const { return file_name; }
+  long get_line_number(void) const { return line_number; }
+  
+  /**
+   * set_demand_paging - select lazy allocation. When enabled, alloc only
+   *   reserves the virtual range; a page is given a zeroed frame (and an L2
+   *   table if needed) the first time it is touched. Takes effect for alloc
+   *   commands executed afterwards.
+   */
+  void set_demand_paging(bool enable) { demand_paging = enable; }
+  
+  /**
+   * Fork - create a child process with a copy-on-write clone of this
+   *   process's address space. No data is copied: both processes map the
+   *   same frames, with writable pages made read-only and marked
+   *   copy-on-write in both; the first write to such a page by either
+   *   process gives it a private copy. The child gets its own page
+   *   directory and L2 tables, writes to the same streams, and continues
+   *   the trace after the current command. The MMU must be in physical or
+   *   this process's mode; it is left as it was.
+   * 
+   * @return child process, or null if there are too few free frames for
+   *   its page tables
+   */
+  std::unique_ptr<ProcessTrace> Fork(void);
+  
+  /**
+   * set_pager - enable eviction: when the allocator runs out of frames the
+   *   pager evicts pages (of any process using it) to make room, and pages
+   *   evicted from this process are read back in when next touched. Set
+   *   before the first command; forked children inherit it.
+   * 
+   * @param pager_ pager to use (null to disable); must outlive the process
+   */
+  void set_pager(Pager *pager_) { pager = pager_; }
+  
+  /**
+   * set_sampling - every interval commands, scan and clear the Accessed and
+   *   Modified bits of all resident pages, recording working-set size and
+   *   page heat (see WorkingSetSampler). The report is written as JSON when
+   *   the process ends. A forked child samples at the same interval and
+   *   writes to report_file with ".<n>" inserted before the extension, n
+   *   counting the forks of this process.
+   * 
+   * @param interval commands between samples (0 to disable)
+   * @param report_file_ path of the JSON report
+   */
+  void set_sampling(uint32_t interval, const std::string &report_file_);
+  
+  /**
+   * set_stats - time each command and count MMU traffic, frames and faults
+   *   into stats (see CommandStats), starting with the page directory
+   *   frame taken by the constructor. Forked children inherit it.
+   * 
+   * @param stats_ statistics to add to (null to disable); must outlive the
+   *   process
+   */
+  void set_stats(CommandStats *stats_);
+  
+  /**
+   * AgePage - clock algorithm test of a resident page (called by Pager). The
+   *   MMU must be in physical mode.
+   * 
+   * @param vaddr virtual address of page
+   * @param modified returns the page's Modified bit
+   * @return true if the page's Accessed bit was set (the bit is cleared)
+   */
+  bool AgePage(Addr vaddr, bool &modified);
+  
+  /**
+   * SwapOutPage - make a page being evicted non-present, recording the swap
+   *   slot holding its contents (called by Pager, which frees the frame).
+   *   The MMU must be in physical mode.
+   */
+  void SwapOutPage(Addr vaddr, uint32_t slot);
+  
+  /**
+   * TakeChildren - move out the processes created by fork commands since
+   *   the last call. Execute doesn't run them; the Scheduler does.
+   * 
+   * @param forked children are pushed on back
+   */
+  void TakeChildren(std::vector<std::unique_ptr<ProcessTrace>> &forked);
+  
+  /**
+   * Save - write the process's trace position, page directory address and
+   *   demand-paging state to a snapshot (see Snapshot.h); its page tables
+   *   and pages are saved with the allocator's frames. Call between
+   *   commands, with the process switched out. Pager and sampling state
+   *   are not saved.
+   * 
+   * @param out snapshot being written
+   */
+  void Save(SnapshotWriter &out);
+  
+  /**
+   * LogModifiedPages - mark in the allocator's dirty log (see
+   *   PageFrameAllocator::EnableDirtyLog) every page written through the
+   *   MMU since the last call, using the pages' Modified bits, which are
+   *   then cleared (the soft-dirty bit keeps them). Pending page-table
+   *   changes are written back first. The MMU is switched to physical mode
+   *   and restored afterwards.
+   */
+  void LogModifiedPages(void);
+  
+  // Decoded trace files by name, so restored processes share them
+  typedef std::map<std::string, std::shared_ptr<const TraceProgram>> ProgramCache;
+  
+  /**
+   * Load - recreate a process written by Save. Its frames must already
+   *   have been restored by PageFrameAllocator::Load; the shadow page
+   *   tables are read back from them. The trace file is decoded again.
+   * 
+   * @param in snapshot being read
+   * @param programs trace files decoded so far (added to)
+   * @return process, switched out, or null if the snapshot is corrupt or
+   *   doesn't match the trace file
+   * @throws TraceError if the trace file can't be opened
+   */
+  static std::unique_ptr<ProcessTrace> Load(SnapshotReader &in, ProgramCache &programs,
+          mem::MMU &memory_, PageFrameAllocator &allocator_,
+          std::ostream &out_ = std::cout, std::ostream &err_ = std::cerr);
+  
 private:
-  // Trace file
+  // Trace file, its decoded commands (shared with forked processes), index
+  // of the next command and line number of the current one
   std::string file_name;
-  std::fstream trace;
+  std::shared_ptr<const TraceProgram> program;
+  size_t pc;
   long line_number;
+  
+  // Buffered standard output; flushed before any error message and at the
+  // end of Execute
+  OutputSink output;
+  
+  // Error messages
+  std::ostream &error;
 
   // Memory contents
   mem::MMU* memory;
   PageFrameAllocator* allocator;
 
   const mem::PMCB physical_pmcb;
+  
+  // This process's PMCB, saved while it is switched out
+  mem::PMCB process_pmcb;
+  
+  // Set when a put completes without a fault; a fused compare right after
+  // it has nothing to check
+  bool put_done;
+  
+  // Physical address of this process's page directory
+  Addr page_directory_base;
+  
+  // Host-side shadows of the page directory and L2 tables (L2 tables
+  // indexed by directory index, null if not present). Page-table edits are
+  // made here and only the changed entries are written back to MMU memory.
+  // Accessed/Modified bits are only maintained in MMU memory. The frames
+  // the process owns are exactly the page directory plus the frames these
+  // tables map.
+  mem::PageTable shadow_dir;
+  std::vector<std::unique_ptr<mem::PageTable>> shadow_l2;
+  
+  // Runs of consecutive shadow entries changed since the last
+  // FlushPageTables
+  struct DirtyRun {
+    Addr paddr;                    // physical address of first entry
+    mem::PageTableEntry *entries;  // first shadow entry
+    uint32_t count;                // number of entries in run
+  };
+  std::vector<DirtyRun> dirty_ptes;
+  
+  // Demand paging: reserved virtual ranges (start -> end, disjoint) not
+  // yet backed by frames, and reserved pages made non-writable before
+  // their first touch (by virtual page number)
+  bool demand_paging;
+  std::map<Addr, uint64_t> reserved;
+  std::set<Addr> demand_readonly;
+  
+  // Reusable staging buffers for command data, and for copying a
+  // copy-on-write page
+  std::vector<uint8_t> io_buffer;
+  std::vector<uint8_t> cow_page;
+  
+  // Children created by fork commands, not yet taken by TakeChildren
+  std::vector<std::unique_ptr<ProcessTrace>> children;
+  
+  // Eviction of pages to swap (null if disabled)
+  Pager *pager;
+  
+  // Working-set sampling (null if disabled), its report file, and number
+  // of children forked (to name their reports)
+  std::unique_ptr<WorkingSetSampler> sampler;
+  std::string report_file;
+  uint32_t forks;
+  
+  // Command latency and counters (null if disabled)
+  CommandStats *stats;
+  
+  // Software L2 entry bit (ignored by the MMU): the page is writable as far
+  // as the trace is concerned, but its frame may be shared with another
+  // process, so the hardware Writable bit is clear until a write copies it
+  static const mem::PageTableEntry kPTE_CopyOnWriteMask = 0x200;
+  
+  // Software L2 entry bit for a non-present page that was evicted; the
+  // frame number field holds its swap slot
+  static const mem::PageTableEntry kPTE_SwappedMask = 0x800;
+  
+  // Software L2 entry bit: the page was modified since it was last read in
+  // (the Modified bit, moved here when sampling clears it)
+  static const mem::PageTableEntry kPTE_SoftDirtyMask = 0x400;
+  
+  // Most frames the allocator may pre-zero after each command
+  static const uint32_t kScrubFramesPerCommand = 4;
+  
+  // Constructor argument: allocate a new, empty page directory
+  static const Addr kNewDirectory = 0xFFFFFFFF;
 
   /**
-   * ParseCommand - parse a trace file command.
-   *   Aborts program if invalid trace file.
-   * 
-   * @param line return the original command line
-   * @param cmd return the command name
-   * @param cmdArgs returns a vector of argument bytes
-   * @return true if command parsed, false if end of file
+   * Constructor for a forked child or restored process: runs program from
+   *   command pc_, with the page directory at directory (kNewDirectory to
+   *   allocate an empty one)
    */
-  bool ParseCommand(
-      std::string &line, std::string &cmd, std::vector<uint32_t> &cmdArgs);
+  ProcessTrace(const std::string &file_name_,
+               std::shared_ptr<const TraceProgram> program_, size_t pc_,
+               mem::MMU &memory_, PageFrameAllocator &allocator_,
+               std::ostream &out_, std::ostream &err_, Addr directory);
   
   /**
    * Command executors. Arguments are the same for each command.
    *   Form of the function is CmdX, where "X' is the command name, capitalized.
-   * @param line original text of command line
-   * @param cmd command, converted to all lower case
-   * @param cmdArgs arguments to command
-   */
-  void CmdAlloc(const std::string &line, 
-               const std::string &cmd, 
-               const std::vector<uint32_t> &cmdArgs);
-  void CmdCompare(const std::string &line, 
-               const std::string &cmd, 
-               const std::vector<uint32_t> &cmdArgs);
-  void CmdPut(const std::string &line, 
-               const std::string &cmd, 
-               const std::vector<uint32_t> &cmdArgs);
-  void CmdFill(const std::string &line, 
-               const std::string &cmd, 
-               const std::vector<uint32_t> &cmdArgs);
-  void CmdCopy(const std::string &line, 
-               const std::string &cmd, 
-               const std::vector<uint32_t> &cmdArgs);
-  void CmdDump(const std::string &line, 
-               const std::string &cmd, 
-               const std::vector<uint32_t> &cmdArgs);
-  void CmdWritable(const std::string &line,
-               const std::string &cmd, 
-               const std::vector<uint32_t> &cmdArgs);
-  void CmdComment(const std::string &line);
+   * @param ins decoded command (operands are listed in TraceProgram.h)
+   */
+  typedef TraceProgram::Instruction Instruction;
+  void CmdAlloc(const Instruction &ins);
+  void CmdCompare(const Instruction &ins);
+  void CmdPut(const Instruction &ins);
+  void CmdFill(const Instruction &ins);
+  void CmdCopy(const Instruction &ins);
+  void CmdDump(const Instruction &ins);
+  void CmdWritable(const Instruction &ins);
+  void CmdFree(const Instruction &ins);
+  void CmdFork(const Instruction &ins);
+  
+  /**
+   * ReportFault - write a memory exception to standard output and cancel
+   *   the partially executed MMU operation
+   * 
+   * @param type exception class name
+   * @param e exception caught
+   */
+  void ReportFault(const char *type, const mem::MemorySubsystemException &e);
+  
+  /**
+   * Abort - write an error message and stop processing the trace
+   * 
+   * @param message error text (one or more lines)
+   * @param exit_status status the program should exit with
+   * @throws TraceError always
+   */
+  [[noreturn]] void Abort(const std::string &message, int exit_status);
+  
+  /**
+   * GetBytes, PutBytes - virtual memory access for trace commands. Page
+   *   faults on evicted pages are resolved by SwapInPage, on reserved but
+   *   unbacked pages by MapDemandPage, and write faults on copy-on-write
+   *   pages by BreakCopyOnWrite; the access is then reissued. Other faults
+   *   are thrown to the caller.
+   */
+  void GetBytes(uint8_t *dest, Addr vaddr, Addr count);
+  void PutBytes(Addr vaddr, Addr count, uint8_t *src);
+  
+  /**
+   * ForEachSpan - split a virtual byte range at page boundaries, so each
+   *   chunk can be moved with a single GetBytes/PutBytes call. A fault is
+   *   then raised at the first byte of the chunk, which is the same address
+   *   a byte-at-a-time access would fault at.
+   * 
+   * @param vaddr first virtual address
+   * @param count number of bytes
+   * @param visit called with virtual address, byte count and offset from
+   *   vaddr of each chunk, in address order
+   */
+  typedef std::function<void(Addr vaddr, Addr count, Addr offset)> SpanVisitor;
+  void ForEachSpan(Addr vaddr, Addr count, const SpanVisitor &visit) const;
+  
+  /**
+   * Reserve - record a virtual range for demand paging
+   */
+  void Reserve(Addr vaddr, Addr num_bytes);
+  
+  /**
+   * Unreserve - remove a virtual range from the demand-paged ranges
+   */
+  void Unreserve(Addr vaddr, Addr num_bytes);
+  
+  /**
+   * IsReserved - test whether vaddr lies in a demand-paged range
+   */
+  bool IsReserved(Addr vaddr) const;
+  
+  /**
+   * MapDemandPage - back the page containing vaddr with a zeroed frame
+   * 
+   * @param vaddr faulting virtual address
+   * @return true if the page was mapped, false if vaddr is not reserved
+   *   (or demand paging is off, or no frames are left)
+   */
+  bool MapDemandPage(Addr vaddr);
+  
+  /**
+   * SamplePages - take a working-set sample: record and clear the Accessed
+   *   and Modified bits of every resident page. Modified bits are kept in
+   *   the soft-dirty bit so eviction still knows the page is dirty.
+   */
+  void SamplePages(void);
+  
+  /**
+   * SwapInPage - read an evicted page back into a new frame
+   * 
+   * @param vaddr faulting virtual address
+   * @return true if the page was brought in, false if it isn't an evicted
+   *   page (or no frame is left)
+   */
+  bool SwapInPage(Addr vaddr);
+  
+  /**
+   * AllocateFrames - allocate page frames, evicting pages to make room if a
+   *   pager is set and the allocator is out of frames. The MMU must be in
+   *   physical mode.
+   * 
+   * @param count number of page frames to allocate
+   * @param frames page frame numbers allocated are pushed on back
+   * @return true if success, false if too few frames (none allocated)
+   */
+  bool AllocateFrames(uint32_t count, std::vector<uint32_t> &frames);
+  
+  /**
+   * MapNewPages - allocate and map a zeroed, writable frame for each page
+   *   in a range that is not yet mapped (or evicted), plus any L2 tables
+   *   needed. The MMU must be in physical mode.
+   * 
+   * @param vaddr first page of range
+   * @param num_pages number of pages in range
+   * @return true if success, false if too few frames (none allocated)
+   */
+  bool MapNewPages(Addr vaddr, uint32_t num_pages);
+  
+  /**
+   * DeallocateFrames - drop this process's reference to page frames,
+   *   counting only the frames actually returned to the allocator (a frame
+   *   still shared copy-on-write stays allocated). The MMU must be in
+   *   physical mode.
+   * 
+   * @param frames page frame numbers to deallocate; the vector is emptied
+   */
+  void DeallocateFrames(std::vector<uint32_t> &frames);
+  
+  /**
+   * BreakCopyOnWrite - make the copy-on-write page containing vaddr
+   *   writable, first copying it to a new frame if its frame is still
+   *   shared
+   * 
+   * @param vaddr virtual address of write fault
+   * @return true if the page is now writable, false if it is not a
+   *   copy-on-write page (or no frame is left for the copy)
+   */
+  bool BreakCopyOnWrite(Addr vaddr);
+  
+  /**
+   * GetL2Entry - look up the shadow L2 entry mapping vaddr
+   * 
+   * @return entry, or 0 (not present) if there is no L2 table
+   */
+  mem::PageTableEntry GetL2Entry(Addr vaddr) const;
+  
+  /**
+   * SetDirEntry, SetL2Entry - change a shadow page table entry and mark it
+   *   for write-back. Setting a present directory entry creates an empty
+   *   shadow for the new L2 table, which must be a freshly allocated frame.
+   */
+  void SetDirEntry(Addr dir_index, mem::PageTableEntry entry);
+  void SetL2Entry(Addr dir_index, Addr l2_offset, mem::PageTableEntry entry);
+  
+  /**
+   * MarkL2Dirty - queue a run of shadow L2 entries, already edited in
+   *   place, for write-back as a single update
+   */
+  void MarkL2Dirty(Addr dir_index, Addr l2_first, Addr count);
+  
+  /**
+   * ForEachL2Run - split a range of virtual pages into runs that each lie
+   *   within a single L2 table, and visit the runs in address order. Used
+   *   by every command that edits page tables over a range.
+   * 
+   * @param vaddr first virtual address (page aligned)
+   * @param num_pages number of pages in range (clipped at top of memory)
+   * @param visit called with directory index, first L2 index and page
+   *   count of each run
+   */
+  typedef std::function<void(Addr dir_index, Addr l2_first, Addr count)> L2RunVisitor;
+  void ForEachL2Run(Addr vaddr, uint32_t num_pages, const L2RunVisitor &visit) const;
+  
+  /**
+   * FlushPageTables - write changed shadow entries back to MMU memory,
+   *   preserving the Accessed/Modified bits set by the MMU. The MMU must be
+   *   in physical mode.
+   */
+  void FlushPageTables(void);
 };
 
 #endif /* PROCESSTRACE_H */
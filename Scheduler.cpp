@@ -0,0 +1,141 @@
+/*
+ * Scheduler implementation
+ */
+
+/* 
+ * File:   Scheduler.cpp
+ */
+
+#include "Scheduler.h"
+#include "Snapshot.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+
+Scheduler::Scheduler(uint32_t time_slice_)
+: time_slice(time_slice_ > 0 ? time_slice_ : 1), running(0), current(0),
+  slice_used(0), line_number(0) {
+}
+
+void Scheduler::Add(std::unique_ptr<ProcessTrace> process) {
+  std::string file_name = process->get_file_name();
+  Process entry = { std::move(process), file_name, 0, 0.0, false };
+  processes.push_back(std::move(entry));
+  ++running;
+}
+
+bool Scheduler::Run(uint64_t max_commands) {
+  uint64_t total = 0;
+  while (running > 0) {
+    if (current == processes.size()) {
+      current = 0;
+    }
+    Process &process = processes[current];
+    if (process.finished) {
+      ++current;
+      continue;
+    } else if (total == max_commands) {
+      return true;
+    }
+    
+    // Run (the rest of) one time slice
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    process.trace->SwitchIn();
+    uint32_t executed = 0;
+    bool ended = false;
+    while (slice_used < time_slice && total < max_commands) {
+      if (!process.trace->Step()) {
+        ended = true;
+        break;
+      }
+      ++executed;
+      ++slice_used;
+      ++total;
+    }
+    if (ended) {
+      process.finished = true;
+      --running;
+    }
+    process.trace->SwitchOut();
+    line_number = std::max(line_number, process.trace->get_line_number());
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    process.commands += executed;
+    process.seconds += elapsed.count();
+    
+    // Children forked during the slice join the end of the run queue
+    std::vector<std::unique_ptr<ProcessTrace>> forked;
+    process.trace->TakeChildren(forked);
+    if (process.finished) {
+      process.trace.reset();  // release the process's frames
+    }
+    for (std::unique_ptr<ProcessTrace> &child : forked) {
+      Add(std::move(child));  // (invalidates process)
+    }
+    
+    // Move on unless stopped partway through the slice
+    if (ended || slice_used == time_slice) {
+      slice_used = 0;
+      ++current;
+    }
+  }
+  return false;
+}
+
+void Scheduler::Save(SnapshotWriter &out) {
+  /* Only running processes are saved; the position is counted among them */
+  size_t position = 0;
+  for (size_t i = 0; i < current && i < processes.size(); ++i) {
+    position += !processes[i].finished;
+  }
+  out.Put32(time_slice);
+  out.Put32(position);
+  out.Put32(slice_used);
+  out.Put32(running);
+  for (Process &process : processes) {
+    if (!process.finished) {
+      process.trace->Save(out);
+    }
+  }
+}
+
+bool Scheduler::Load(SnapshotReader &in, mem::MMU &memory, PageFrameAllocator &allocator,
+                     const ProcessSetup &setup) {
+  time_slice = in.Get32();
+  current = in.Get32();
+  slice_used = in.Get32();
+  uint32_t count = in.Get32();
+  if (in.fail() || !processes.empty() || time_slice == 0 || slice_used >= time_slice
+      || current > count) {
+    return false;
+  }
+  ProcessTrace::ProgramCache programs;
+  for (uint32_t i = 0; i < count; ++i) {
+    std::unique_ptr<ProcessTrace> process(ProcessTrace::Load(in, programs, memory, allocator));
+    if (!process) {
+      return false;
+    }
+    setup(*process);
+    line_number = std::max(line_number, process->get_line_number());
+    Add(std::move(process));
+  }
+  return true;
+}
+
+void Scheduler::LogModifiedPages(void) {
+  for (Process &process : processes) {
+    if (!process.finished) {
+      process.trace->LogModifiedPages();
+    }
+  }
+}
+
+void Scheduler::Report(std::ostream &out) const {
+  for (const Process &process : processes) {
+    double rate = process.seconds > 0 ? process.commands / process.seconds : 0;
+    out << process.file_name << ": " << std::dec
+        << process.commands << " commands in " << std::fixed
+        << std::setprecision(6) << process.seconds << " s ("
+        << std::setprecision(0) << rate << " commands/s)\n";
+  }
+}
@@ -0,0 +1,138 @@
+/*
+ * Scheduler - run several ProcessTrace instances on one shared MMU
+ * 
+ * Processes are run round-robin, each for a time slice of a fixed number
+ * of trace commands. On each context switch the outgoing process saves its
+ * PMCB and the incoming process loads its own, so every process runs with
+ * its own page directory. Processes created by fork commands are added to
+ * the end of the run queue. A process that reaches the end of its trace is
+ * destroyed right away, so its frames can be reused by the others.
+ * 
+ * A run can be stopped after a number of commands, even in the middle of
+ * a time slice, and carried on later (or saved to a snapshot and restored,
+ * see Snapshot.h) with the same interleaving it would have had.
+ */
+
+/* 
+ * File:   Scheduler.h
+ */
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include "ProcessTrace.h"
+
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+class Scheduler {
+public:
+  /**
+   * Constructor
+   * 
+   * @param time_slice_ number of commands a process runs before switching
+   */
+  Scheduler(uint32_t time_slice_);
+  
+  virtual ~Scheduler(void) {}
+  
+  // Disallow copy/move
+  Scheduler(const Scheduler &other) = delete;
+  Scheduler(Scheduler &&other) = delete;
+  Scheduler &operator=(const Scheduler &other) = delete;
+  Scheduler &operator=(Scheduler &&other) = delete;
+  
+  /**
+   * Add - add a process to the end of the run queue
+   * 
+   * @param process process to run (owned by the scheduler from now on)
+   */
+  void Add(std::unique_ptr<ProcessTrace> process);
+  
+  /**
+   * Run - interleave all processes until every trace has ended, or until
+   *   max_commands commands have been executed by this call
+   * 
+   * @param max_commands most commands to execute
+   * @return true if stopped with processes still running (Run again to
+   *   continue where it left off)
+   */
+  bool Run(uint64_t max_commands = std::numeric_limits<uint64_t>::max());
+  
+  /**
+   * Save - write the time slice, the position in the run queue and every
+   *   running process to a snapshot (see Snapshot.h). Call between Run
+   *   calls.
+   * 
+   * @param out snapshot being written
+   */
+  void Save(SnapshotWriter &out);
+  
+  /**
+   * Load - add the processes written by Save to the (empty) run queue,
+   *   continuing at the saved position and with the saved time slice. The
+   *   allocator must already have been loaded from the snapshot.
+   * 
+   * @param in snapshot being read
+   * @param setup called with each process before it is added (e.g. to
+   *   set statistics)
+   * @return true if success, false if the snapshot is corrupt or doesn't
+   *   match the trace files
+   * @throws TraceError if a trace file can't be opened
+   */
+  typedef std::function<void(ProcessTrace &process)> ProcessSetup;
+  bool Load(SnapshotReader &in, mem::MMU &memory, PageFrameAllocator &allocator,
+            const ProcessSetup &setup);
+  
+  /**
+   * LogModifiedPages - ProcessTrace::LogModifiedPages for every running
+   *   process. Call between Run calls.
+   */
+  void LogModifiedPages(void);
+  
+  /**
+   * get_line_number - highest trace line number executed so far by any
+   *   process (0 if none has executed a command)
+   */
+  long get_line_number(void) const { return line_number; }
+  
+  /**
+   * Report - write commands executed, run time and throughput of each
+   *   process
+   * 
+   * @param out stream to write report to
+   */
+  void Report(std::ostream &out) const;
+  
+private:
+  // Process and its accounting
+  struct Process {
+    std::unique_ptr<ProcessTrace> trace;  // null once finished
+    std::string file_name;
+    uint64_t commands;   // commands executed
+    double seconds;      // time spent running its slices
+    bool finished;       // trace has ended
+  };
+  
+  // All processes, in run order
+  std::vector<Process> processes;
+  
+  // Commands per time slice
+  uint32_t time_slice;
+  
+  // Processes not yet finished; index of the process whose slice is next
+  // (or under way), and commands it has run in the slice so far
+  size_t running;
+  size_t current;
+  uint32_t slice_used;
+  
+  // Highest line number executed by any process
+  long line_number;
+};
+
+#endif /* SCHEDULER_H */
@@ -0,0 +1,118 @@
+/*
+ * Snapshot implementation
+ */
+
+/*
+ * File:   Snapshot.cpp
+ */
+
+#include "Snapshot.h"
+
+#include <cstring>
+
+const char SnapshotReader::kMagic[8] = { 'A', '2', 'S', 'N', 'A', 'P', 'S', 'H' };
+const char SnapshotReader::kLogMagic[8] = { 'A', '2', 'C', 'K', 'P', 'T', 'L', 'G' };
+const uint32_t SnapshotReader::kVersion;
+
+SnapshotWriter::SnapshotWriter(const std::string &file_name, uint32_t frame_count,
+                               PageFrameAllocator::Mode mode, bool log)
+: out(file_name, std::ios_base::out | std::ios_base::binary | std::ios_base::trunc) {
+  PutBytes(log ? SnapshotReader::kLogMagic : SnapshotReader::kMagic,
+           sizeof(SnapshotReader::kMagic));
+  Put32(SnapshotReader::kVersion);
+  Put32(frame_count);
+  Put32(mode);
+}
+
+void SnapshotWriter::Put32(uint32_t value) {
+  char bytes[4];
+  for (int i = 0; i < 4; ++i) {
+    bytes[i] = static_cast<char>(value >> (8*i));
+  }
+  out.write(bytes, sizeof(bytes));
+}
+
+void SnapshotWriter::Put64(uint64_t value) {
+  Put32(static_cast<uint32_t>(value));
+  Put32(static_cast<uint32_t>(value >> 32));
+}
+
+void SnapshotWriter::PutBytes(const void *data, size_t size) {
+  out.write(static_cast<const char*>(data), size);
+}
+
+void SnapshotWriter::PutString(const std::string &value) {
+  Put32(value.size());
+  PutBytes(value.data(), value.size());
+}
+
+void SnapshotWriter::Put64At(uint64_t offset, uint64_t value) {
+  std::ofstream::pos_type end = out.tellp();
+  out.seekp(offset);
+  Put64(value);
+  out.seekp(end);
+}
+
+bool SnapshotWriter::Close(void) {
+  out.close();
+  return !out.fail();
+}
+
+SnapshotReader::SnapshotReader(const std::string &file_name)
+: file(file_name), data(reinterpret_cast<const uint8_t*>(file.get_mapped_data())),
+  size(file.get_mapped_size()), position(0), truncated(false),
+  frame_count(0), mode(PageFrameAllocator::kFreeList), log(false) {
+  if (!file.is_open()) {
+    error = "ERROR: failed to open snapshot file: " + file_name + "\n";
+    return;
+  }
+  const uint8_t *magic = GetBytes(sizeof(kMagic));
+  uint32_t version = Get32();
+  frame_count = Get32();
+  uint32_t mode_value = Get32();
+  log = !fail() && memcmp(magic, kLogMagic, sizeof(kLogMagic)) == 0;
+  if (data == nullptr || fail() || (!log && memcmp(magic, kMagic, sizeof(kMagic)) != 0)) {
+    error = "ERROR: not a snapshot file: " + file_name + "\n";
+  } else if (version != kVersion || frame_count == 0
+             || mode_value > PageFrameAllocator::kBuddy) {
+    error = "ERROR: unsupported snapshot file: " + file_name + "\n";
+  }
+  mode = static_cast<PageFrameAllocator::Mode>(mode_value);
+}
+
+uint32_t SnapshotReader::Get32(void) {
+  const uint8_t *p = GetBytes(4);
+  if (p == nullptr) {
+    return 0;
+  }
+  return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+uint64_t SnapshotReader::Get64(void) {
+  uint64_t low = Get32();
+  return low | static_cast<uint64_t>(Get32()) << 32;
+}
+
+std::string SnapshotReader::GetString(void) {
+  uint32_t length = Get32();
+  const uint8_t *p = GetBytes(length);
+  return p ? std::string(reinterpret_cast<const char*>(p), length) : std::string();
+}
+
+void SnapshotReader::Seek(uint64_t offset) {
+  if (offset > size) {
+    truncated = true;
+  } else {
+    position = offset;
+  }
+}
+
+const uint8_t *SnapshotReader::GetBytes(size_t count) {
+  if (truncated || data == nullptr || count > size - position) {
+    truncated = true;
+    return nullptr;
+  }
+  const uint8_t *p = data + position;
+  position += count;
+  return p;
+}
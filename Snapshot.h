@@ -0,0 +1,179 @@
+/*
+ * Snapshot - save the simulated machine to a file and restore it
+ *
+ * A snapshot holds everything needed to carry on a run from a point
+ * between commands: the contents of the page frames in use, the page
+ * frame allocator's free frames (see PageFrameAllocator::Save) and the
+ * scheduler's live processes, with each one's trace position, page
+ * directory and demand-paging reservations (see Scheduler::Save). Free
+ * frames are not saved, so the file is about the size of the memory in
+ * use. Page tables are not saved separately; they are in the frames, and
+ * a restored process rebuilds its shadow tables from them.
+ *
+ * A restored run produces the same output from that point as the run the
+ * snapshot was taken from. The trace files are decoded again on restore,
+ * so they must not have changed.
+ *
+ * SnapshotWriter streams the sections to the file as they are saved.
+ * SnapshotReader maps the file (see TraceReader) and reads it in place;
+ * frame contents are copied from the mapping straight into the MMU. All
+ * integers are little-endian.
+ *
+ * Layout:
+ *   header     - magic, version, frame count, allocator mode
+ *   allocator  - PageFrameAllocator::Save
+ *   scheduler  - Scheduler::Save
+ *
+ * A checkpoint log (see CheckpointLog.h) has the same header with its own
+ * magic, followed by a series of checkpoints in much the same form.
+ */
+
+/*
+ * File:   Snapshot.h
+ */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "PageFrameAllocator.h"
+#include "TraceReader.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <string>
+
+class SnapshotWriter {
+public:
+  /**
+   * Constructor - create the snapshot file and write its header
+   *
+   * @param file_name snapshot file to create
+   * @param frame_count page frames in the MMU
+   * @param mode allocator backend
+   * @param log true for a checkpoint log
+   */
+  SnapshotWriter(const std::string &file_name, uint32_t frame_count,
+                 PageFrameAllocator::Mode mode, bool log = false);
+
+  virtual ~SnapshotWriter(void) {}
+
+  // Disallow copy/move
+  SnapshotWriter(const SnapshotWriter &other) = delete;
+  SnapshotWriter(SnapshotWriter &&other) = delete;
+  SnapshotWriter &operator=(const SnapshotWriter &other) = delete;
+  SnapshotWriter &operator=(SnapshotWriter &&other) = delete;
+
+  /**
+   * Put32, Put64, PutBytes, PutString - append a value
+   */
+  void Put32(uint32_t value);
+  void Put64(uint64_t value);
+  void PutBytes(const void *data, size_t size);
+  void PutString(const std::string &value);
+
+  /**
+   * Tell - offset in the file of the next value written
+   */
+  uint64_t Tell(void) { return out.tellp(); }
+
+  /**
+   * Put64At - overwrite a value written earlier (e.g. a size not known
+   *   until later)
+   *
+   * @param offset offset of the value, from Tell
+   */
+  void Put64At(uint64_t offset, uint64_t value);
+
+  /**
+   * Close - finish writing the file
+   *
+   * @return true if the file was created and every write succeeded
+   */
+  bool Close(void);
+
+private:
+  std::ofstream out;
+};
+
+class SnapshotReader {
+public:
+  /**
+   * Constructor - map a snapshot file and check its header
+   *
+   * @param file_name snapshot file
+   */
+  SnapshotReader(const std::string &file_name);
+
+  virtual ~SnapshotReader(void) {}
+
+  // Disallow copy/move
+  SnapshotReader(const SnapshotReader &other) = delete;
+  SnapshotReader(SnapshotReader &&other) = delete;
+  SnapshotReader &operator=(const SnapshotReader &other) = delete;
+  SnapshotReader &operator=(SnapshotReader &&other) = delete;
+
+  /**
+   * ok - true if the file was opened and has a snapshot (or checkpoint
+   *   log) header; otherwise get_error describes the problem
+   */
+  bool ok(void) const { return error.empty(); }
+  const std::string &get_error(void) const { return error; }
+
+  // Header values
+  uint32_t get_frame_count(void) const { return frame_count; }
+  PageFrameAllocator::Mode get_mode(void) const { return mode; }
+  bool is_log(void) const { return log; }
+
+  /**
+   * Get32, Get64, GetString - read the next value (0 or empty past the
+   *   end of the file, which sets fail)
+   */
+  uint32_t Get32(void);
+  uint64_t Get64(void);
+  std::string GetString(void);
+
+  /**
+   * GetBytes - read the next size bytes in place
+   *
+   * @return pointer into the mapped file, or null past the end of the file
+   *   (which sets fail)
+   */
+  const uint8_t *GetBytes(size_t size);
+
+  /**
+   * fail - true if a read went past the end of the file
+   */
+  bool fail(void) const { return truncated; }
+
+  /**
+   * get_position, Seek - offset of the next value to read, and move to
+   *   another offset (past the end of the file sets fail)
+   */
+  uint64_t get_position(void) const { return position; }
+  void Seek(uint64_t offset);
+
+  /**
+   * at_end - true if every byte of the file has been read
+   */
+  bool at_end(void) const { return position == size; }
+
+  // Header layout
+  static const char kMagic[8];
+  static const char kLogMagic[8];
+  static const uint32_t kVersion = 1;
+
+private:
+  TraceReader file;
+  const uint8_t *data;
+  size_t size;
+  size_t position;
+  bool truncated;
+
+  std::string error;
+  uint32_t frame_count;
+  PageFrameAllocator::Mode mode;
+  bool log;
+};
+
+#endif /* SNAPSHOT_H */
@@ -0,0 +1,154 @@
+/*
+ * TraceProgram implementation
+ */
+
+/*
+ * File:   TraceProgram.cpp
+ */
+
+#include "TraceProgram.h"
+#include "TraceReader.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace {
+
+// Operands each command needs, before any payload (indexed by opcode)
+const uint32_t kFixedOperands[BinaryTrace::kOpcodeCount] = {
+  2,  // alloc
+  1,  // compare
+  1,  // put
+  3,  // fill
+  3,  // copy
+  2,  // dump
+  3,  // writable
+  0,  // comment
+  2,  // free
+  0,  // fork
+};
+
+}  // namespace
+
+TraceProgram::TraceProgram(const std::string &file_name)
+: end(kComplete) {
+  TraceReader trace(file_name);
+  if (!trace.is_open()) {
+    error = "ERROR: failed to open trace file: " + file_name + "\n";
+    return;
+  }
+
+  std::vector<uint32_t> values;
+  if (BinaryTrace::IsBinary(trace.get_mapped_data(), trace.get_mapped_size())) {
+    BinaryTrace binary(trace.get_mapped_data(), trace.get_mapped_size());
+    if (!binary.valid()) {
+      error = "ERROR: unsupported compiled trace file: " + file_name + "\n";
+      return;
+    }
+    BinaryTrace::Record record;
+    while (binary.Next(record)) {
+      values.clear();
+      if (record.opcode != BinaryTrace::kComment) {
+        if (record.form == BinaryTrace::kBytes) {
+          values.push_back(record.addr);
+          values.insert(values.end(), record.operands, record.operands + record.count);
+        } else {
+          for (uint32_t i = 0; i < record.count; ++i) {
+            values.push_back(BinaryTrace::Word(record.operands, i));
+          }
+        }
+      }
+      if (record.text) {
+        Add(record.opcode, record.line_number, record.text, record.text_length, values);
+      } else {
+        std::string text = BinaryTrace::FormatCommand(record.opcode, values);
+        Add(record.opcode, record.line_number, text.data(), text.size(), values);
+      }
+    }
+    if (binary.fail()) {
+      end = kCorrupt;
+    }
+    return;
+  }
+
+  const char *line;
+  size_t length;
+  uint32_t line_number = 0;
+  while (trace.NextLine(line, length)) {
+    ++line_number;
+
+    // Command is the first white space delimited token; the remainder of
+    // a comment is not parsed
+    const char *p = line;
+    const char *line_end = line + length;
+    while (p < line_end && TraceReader::IsSpace(*p)) ++p;
+    const char *cmd_start = p;
+    while (p < line_end && !TraceReader::IsSpace(*p)) ++p;
+    BinaryTrace::Opcode opcode = BinaryTrace::LookupOpcode(std::string(cmd_start, p - cmd_start));
+    values.clear();
+    if (opcode != BinaryTrace::kComment) {
+      TraceReader::ParseHex(p, line_end, values);
+    }
+    Add(opcode, line_number, line, length, values);
+  }
+  if (trace.fail()) {
+    end = kReadFailed;
+  }
+}
+
+void TraceProgram::Add(BinaryTrace::Opcode opcode, uint32_t line_number,
+        const char *line, size_t length, const std::vector<uint32_t> &values) {
+  Instruction ins;
+  ins.opcode = opcode;
+  ins.form = BinaryTrace::kWords;
+  ins.fused = false;
+  ins.line_number = line_number;
+  std::fill(ins.args, ins.args + 3, 0);
+  ins.payload_count = 0;
+  ins.payload_offset = 0;
+  ins.text_offset = text.size();
+  ins.text_length = length;
+  text.insert(text.end(), line, line + length);
+
+  if (opcode >= BinaryTrace::kOpcodeCount || values.size() < kFixedOperands[opcode]) {
+    ins.opcode = BinaryTrace::kUnknown;  // reported as invalid when executed
+    instructions.push_back(ins);
+    return;
+  }
+  std::copy(values.begin(), values.begin() + kFixedOperands[opcode], ins.args);
+
+  /* put stores only the low byte of each value; compare needs the whole
+   * value if any doesn't fit in a byte (it can never match) */
+  if (opcode == BinaryTrace::kPut || opcode == BinaryTrace::kCompare) {
+    ins.payload_count = values.size() - 1;
+    bool all_bytes = opcode == BinaryTrace::kPut
+            || std::all_of(values.begin() + 1, values.end(),
+                           [](uint32_t value) { return value <= 0xFF; });
+    if (all_bytes) {
+      ins.form = BinaryTrace::kBytes;
+      ins.payload_offset = bytes.size();
+      for (size_t i = 1; i < values.size(); ++i) {
+        bytes.push_back(static_cast<uint8_t>(values[i]));
+      }
+    } else {
+      ins.payload_offset = words.size();
+      words.insert(words.end(), values.begin() + 1, values.end());
+    }
+    if (opcode == BinaryTrace::kCompare) {
+      FuseWithPut(ins);
+    }
+  }
+  instructions.push_back(ins);
+}
+
+void TraceProgram::FuseWithPut(Instruction &compare) const {
+  if (instructions.empty() || compare.form != BinaryTrace::kBytes) {
+    return;
+  }
+  const Instruction &put = instructions.back();
+  compare.fused = put.opcode == BinaryTrace::kPut
+          && put.args[0] == compare.args[0]
+          && put.payload_count == compare.payload_count
+          && (compare.payload_count == 0
+              || memcmp(Bytes(put), Bytes(compare), compare.payload_count) == 0);
+}
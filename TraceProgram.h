@@ -0,0 +1,121 @@
+/*
+ * TraceProgram - a trace file decoded once into instructions
+ *
+ * The whole trace, text or compiled (see BinaryTrace.h), is lowered when it
+ * is opened into a vector of fixed-size instructions: an opcode, the
+ * command's fixed operands, and for put and compare a slice of a shared
+ * payload array holding the values. Executing a trace is then a walk over
+ * the vector with a switch on the opcode; nothing is parsed or looked up
+ * by name. The line text is kept for echoing to the output.
+ *
+ * A compare that checks exactly the bytes the preceding put wrote, at the
+ * same address, is marked as fused with it (see Instruction::fused).
+ *
+ * A program is not changed after it is decoded, so processes forked from
+ * one another share it.
+ */
+
+/*
+ * File:   TraceProgram.h
+ */
+
+#ifndef TRACEPROGRAM_H
+#define TRACEPROGRAM_H
+
+#include "BinaryTrace.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+class TraceProgram {
+public:
+  // One decoded command. Operands of each opcode:
+  //   alloc, free    vaddr, size
+  //   fill           addr, count, value
+  //   copy           dest_addr, src_addr, count
+  //   dump           addr, count
+  //   writable       vaddr, size, status
+  //   put, compare   addr; values are the payload slice
+  // Commands with too few operands, and unknown commands, have opcode
+  // kUnknown.
+  struct Instruction {
+    BinaryTrace::Opcode opcode;
+    BinaryTrace::Form form;   // payload: kBytes, or kWords (compare only)
+    bool fused;               // compare of the bytes just put at addr
+    uint32_t line_number;
+    uint32_t args[3];
+    uint32_t payload_count;   // number of values
+    size_t payload_offset;    // first value in bytes or words
+    size_t text_offset;       // line text
+    uint32_t text_length;
+  };
+
+  // How decoding ended
+  enum End { kComplete, kReadFailed, kCorrupt };
+
+  /**
+   * Constructor - open and decode a trace file
+   *
+   * @param file_name trace file
+   */
+  TraceProgram(const std::string &file_name);
+
+  virtual ~TraceProgram(void) {}
+
+  // Disallow copy/move
+  TraceProgram(const TraceProgram &other) = delete;
+  TraceProgram(TraceProgram &&other) = delete;
+  TraceProgram &operator=(const TraceProgram &other) = delete;
+  TraceProgram &operator=(TraceProgram &&other) = delete;
+
+  /**
+   * ok - true if the file was opened and recognized; otherwise get_error
+   *   describes the problem and the program is empty
+   */
+  bool ok(void) const { return error.empty(); }
+  const std::string &get_error(void) const { return error; }
+
+  /**
+   * get_end - whether decoding reached the end of the file, or stopped at
+   *   a read error or corrupt compiled record after the last instruction
+   */
+  End get_end(void) const { return end; }
+
+  // Access to instructions and their data
+  size_t size(void) const { return instructions.size(); }
+  const Instruction &operator[](size_t i) const { return instructions[i]; }
+  const uint8_t *Bytes(const Instruction &ins) const { return bytes.data() + ins.payload_offset; }
+  const uint32_t *Words(const Instruction &ins) const { return words.data() + ins.payload_offset; }
+  const char *Text(const Instruction &ins) const { return text.data() + ins.text_offset; }
+
+private:
+  std::vector<Instruction> instructions;
+
+  // Payload values of all put and compare instructions, and all line text
+  std::vector<uint8_t> bytes;
+  std::vector<uint32_t> words;
+  std::vector<char> text;
+
+  std::string error;
+  End end;
+
+  /**
+   * Add - lower one command and append it
+   *
+   * @param opcode command
+   * @param line_number trace line
+   * @param line, length text of line
+   * @param values all numeric arguments, in order
+   */
+  void Add(BinaryTrace::Opcode opcode, uint32_t line_number,
+           const char *line, size_t length, const std::vector<uint32_t> &values);
+
+  /**
+   * FuseWithPut - mark a compare as fused if the previous instruction is a
+   *   put of the same bytes to the same address
+   */
+  void FuseWithPut(Instruction &compare) const;
+};
+
+#endif /* TRACEPROGRAM_H */
@@ -0,0 +1,152 @@
+/*
+ * TraceReader implementation
+ */
+
+/* 
+ * File:   TraceReader.cpp
+ */
+
+#include "TraceReader.h"
+
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+// Value of each hex digit character, 0xFF for all other characters
+struct HexTable {
+  uint8_t value[256];
+  HexTable() {
+    memset(value, 0xFF, sizeof(value));
+    for (int c = '0'; c <= '9'; ++c) value[c] = c - '0';
+    for (int c = 'a'; c <= 'f'; ++c) value[c] = c - 'a' + 10;
+    for (int c = 'A'; c <= 'F'; ++c) value[c] = c - 'A' + 10;
+  }
+};
+const HexTable kHex;
+
+}  // namespace
+
+TraceReader::TraceReader(const std::string &file_name_)
+: mapped(nullptr), mapped_size(0), position(0),
+  stream(nullptr), block_begin(0), block_end(0), read_error(false) {
+  // Map regular, non-empty files
+  int fd = open(file_name_.c_str(), O_RDONLY);
+  if (fd >= 0) {
+    struct stat info;
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+      void *addr = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (addr != MAP_FAILED) {
+        madvise(addr, info.st_size, MADV_SEQUENTIAL);
+        mapped = static_cast<const char*>(addr);
+        mapped_size = info.st_size;
+      }
+    }
+    close(fd);
+  }
+  
+  // Otherwise read the file in blocks
+  if (mapped == nullptr) {
+    stream = fopen(file_name_.c_str(), "r");
+  }
+}
+
+TraceReader::~TraceReader(void) {
+  if (mapped != nullptr) {
+    munmap(const_cast<char*>(mapped), mapped_size);
+  }
+  if (stream != nullptr) {
+    fclose(stream);
+  }
+}
+
+bool TraceReader::NextLine(const char *&line, size_t &length) {
+  if (mapped == nullptr) {
+    return NextBlockLine(line, length);
+  }
+  if (position >= mapped_size) {
+    return false;
+  }
+  
+  line = mapped + position;
+  const char *newline = static_cast<const char*>(
+          memchr(line, '\n', mapped_size - position));
+  if (newline != nullptr) {
+    length = newline - line;
+    position += length + 1;
+  } else {
+    length = mapped_size - position;  // last line has no newline
+    position = mapped_size;
+  }
+  return true;
+}
+
+bool TraceReader::NextBlockLine(const char *&line, size_t &length) {
+  if (stream == nullptr) {
+    return false;
+  }
+  for (;;) {
+    // Return a complete line if one is buffered
+    const char *start = block.data() + block_begin;
+    const char *newline = static_cast<const char*>(
+            memchr(start, '\n', block_end - block_begin));
+    if (newline != nullptr) {
+      line = start;
+      length = newline - start;
+      block_begin += length + 1;
+      return true;
+    }
+    
+    // Move the partial line to the front and read another block
+    memmove(block.data(), start, block_end - block_begin);
+    block_end -= block_begin;
+    block_begin = 0;
+    if (block.size() < block_end + kBlockSize) {
+      block.resize(block_end + kBlockSize);
+    }
+    size_t count = fread(block.data() + block_end, 1, kBlockSize, stream);
+    block_end += count;
+    if (count == 0) {
+      read_error = ferror(stream) != 0;
+      if (block_end == 0 || read_error) {
+        return false;
+      }
+      line = block.data();  // last line has no newline
+      length = block_end;
+      block_begin = block_end;
+      return true;
+    }
+  }
+}
+
+void TraceReader::ParseHex(const char *p, const char *end,
+                           std::vector<uint32_t> &values) {
+  for (;;) {
+    while (p < end && IsSpace(*p)) {
+      ++p;
+    }
+    if (end - p >= 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+      p += 2;
+    }
+    
+    // Accumulate digits; a nonzero top nibble before a shift means overflow
+    uint32_t value = 0;
+    uint32_t overflow = 0;
+    const char *digits = p;
+    uint8_t digit;
+    while (p < end
+           && (digit = kHex.value[static_cast<unsigned char>(*p)]) != 0xFF) {
+      overflow |= value >> 28;
+      value = (value << 4) | digit;
+      ++p;
+    }
+    if (p == digits || overflow != 0) {
+      return;
+    }
+    values.push_back(value);
+  }
+}
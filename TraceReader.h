@@ -0,0 +1,113 @@
+/*
+ * TraceReader - read trace file lines in place
+ * 
+ * The file is memory-mapped when possible, so lines are handed out as
+ * pointers into the mapping without copying. Files that can't be mapped
+ * (pipes, special files) are read in large blocks instead.
+ */
+
+/* 
+ * File:   TraceReader.h
+ */
+
+#ifndef TRACEREADER_H
+#define TRACEREADER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+class TraceReader {
+public:
+  /**
+   * Constructor - open trace file
+   * 
+   * @param file_name_ trace file to read
+   */
+  TraceReader(const std::string &file_name_);
+  
+  /**
+   * Destructor - unmap and close file
+   */
+  virtual ~TraceReader(void);
+  
+  // Disallow copy/move
+  TraceReader(const TraceReader &other) = delete;
+  TraceReader(TraceReader &&other) = delete;
+  TraceReader &operator=(const TraceReader &other) = delete;
+  TraceReader &operator=(TraceReader &&other) = delete;
+  
+  /**
+   * is_open - true if file was opened successfully
+   */
+  bool is_open(void) const { return mapped != nullptr || stream != nullptr; }
+  
+  /**
+   * NextLine - get the next line of the file, without its newline. The line
+   *   is valid until the next call to NextLine.
+   * 
+   * @param line returns pointer to first character of line
+   * @param length returns number of characters in line
+   * @return true if line returned, false if end of file
+   */
+  bool NextLine(const char *&line, size_t &length);
+  
+  /**
+   * get_mapped_data, get_mapped_size - whole file contents, if the file is
+   *   memory-mapped (null and 0 if it is read in blocks)
+   */
+  const char *get_mapped_data(void) const { return mapped; }
+  size_t get_mapped_size(void) const { return mapped_size; }
+  
+  /**
+   * fail - true if a read error occurred (as opposed to end of file)
+   */
+  bool fail(void) const { return read_error; }
+  
+  /**
+   * ParseHex - parse hexadecimal numbers separated by white space, the way
+   *   "stream >> std::hex" would: an optional 0x prefix is accepted, and
+   *   parsing stops at the first token that does not begin with a hex digit
+   *   or does not fit in 32 bits.
+   * 
+   * @param p first character to parse
+   * @param end one past last character to parse
+   * @param values numbers parsed are pushed on back
+   */
+  static void ParseHex(const char *p, const char *end,
+                       std::vector<uint32_t> &values);
+  
+  /**
+   * IsSpace - white space test matching std::isspace in the "C" locale
+   */
+  static bool IsSpace(char c) {
+    return c == ' ' || (c >= '\t' && c <= '\r');
+  }
+  
+private:
+  // Memory-mapped file contents (null if not mapped), and next position
+  const char *mapped;
+  size_t mapped_size;
+  size_t position;
+  
+  // Block-read fallback: open file, buffered data and unread portion
+  FILE *stream;
+  std::vector<char> block;
+  size_t block_begin;
+  size_t block_end;
+  
+  // Set if a read failed
+  bool read_error;
+  
+  // Size of blocks for fallback reads
+  static const size_t kBlockSize = 1 << 20;
+  
+  /**
+   * NextBlockLine - NextLine for the block-read fallback
+   */
+  bool NextBlockLine(const char *&line, size_t &length);
+};
+
+#endif /* TRACEREADER_H */
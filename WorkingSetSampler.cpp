@@ -0,0 +1,82 @@
+/*
+ * WorkingSetSampler implementation
+ */
+
+/* 
+ * File:   WorkingSetSampler.cpp
+ */
+
+#include "WorkingSetSampler.h"
+
+#include <iomanip>
+
+const mem::Addr WorkingSetSampler::kRegionSize;
+
+WorkingSetSampler::WorkingSetSampler(uint32_t interval_)
+: interval(interval_ > 0 ? interval_ : 1), commands(0) {
+  current = Sample{ 0, 0, 0, 0, 0 };
+}
+
+void WorkingSetSampler::RecordPage(mem::Addr vaddr, bool accessed, bool modified) {
+  ++current.resident;
+  if (!accessed && !modified) {
+    return;
+  }
+  PageHeat &page = heat[vaddr >> mem::kPageSizeBits];
+  if (accessed) {
+    ++current.working_set;
+    ++page.accessed;
+  }
+  if (modified) {
+    ++current.dirty;
+    ++page.modified;
+  }
+}
+
+void WorkingSetSampler::EndSample(long line_number) {
+  current.command = commands;
+  current.line_number = line_number;
+  samples.push_back(current);
+  current = Sample{ 0, 0, 0, 0, 0 };
+}
+
+void WorkingSetSampler::WriteJson(std::ostream &out, const std::string &trace_name) const {
+  out << "{\n  \"trace\": \"";
+  for (char c : trace_name) {
+    if (c == '"' || c == '\\') out << '\\';
+    out << c;
+  }
+  out << "\",\n  \"interval\": " << std::dec << interval
+      << ",\n  \"page_size\": " << mem::kPageSize
+      << ",\n  \"samples\": [";
+  for (size_t i = 0; i < samples.size(); ++i) {
+    const Sample &sample = samples[i];
+    out << (i > 0 ? ",\n" : "\n") << "    {\"command\": " << sample.command
+        << ", \"line\": " << sample.line_number
+        << ", \"working_set\": " << sample.working_set
+        << ", \"dirty\": " << sample.dirty
+        << ", \"resident\": " << sample.resident << "}";
+  }
+  out << "\n  ],\n  \"region_size\": " << kRegionSize << ",\n  \"regions\": [";
+  
+  /* Sum the page counts of each region (pages are in address order) */
+  const mem::Addr region_pages = kRegionSize >> mem::kPageSizeBits;
+  bool first = true;
+  std::map<mem::Addr, PageHeat>::const_iterator page = heat.begin();
+  while (page != heat.end()) {
+    mem::Addr region = page->first / region_pages;
+    uint32_t pages = 0;
+    uint64_t accessed = 0;
+    uint64_t modified = 0;
+    for (; page != heat.end() && page->first / region_pages == region; ++page) {
+      ++pages;
+      accessed += page->second.accessed;
+      modified += page->second.modified;
+    }
+    out << (first ? "\n" : ",\n") << "    {\"vaddr\": \"0x" << std::hex
+        << uint64_t(region) * kRegionSize << std::dec << "\", \"pages\": " << pages
+        << ", \"accessed\": " << accessed << ", \"modified\": " << modified << "}";
+    first = false;
+  }
+  out << "\n  ]\n}\n";
+}
@@ -0,0 +1,114 @@
+/*
+ * WorkingSetSampler - working-set and page-heat statistics for a process
+ * 
+ * The process scans the Accessed and Modified bits of its L2 entries at a
+ * fixed interval of trace commands, clearing them as it goes, and passes
+ * each page's bits to the sampler. The sampler keeps a time series of
+ * working-set size (pages accessed during the interval), pages modified
+ * and resident pages, and for each page the number of intervals in which
+ * it was accessed and modified. The report is written as JSON, with the
+ * page counts summed over fixed-size virtual regions.
+ */
+
+/* 
+ * File:   WorkingSetSampler.h
+ */
+
+#ifndef WORKINGSETSAMPLER_H
+#define WORKINGSETSAMPLER_H
+
+#include <MMU.h>
+
+#include <cstdint>
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+
+class WorkingSetSampler {
+public:
+  /**
+   * Constructor
+   * 
+   * @param interval_ trace commands between samples
+   */
+  WorkingSetSampler(uint32_t interval_);
+  
+  virtual ~WorkingSetSampler(void) {}
+  
+  // Disallow copy/move
+  WorkingSetSampler(const WorkingSetSampler &other) = delete;
+  WorkingSetSampler(WorkingSetSampler &&other) = delete;
+  WorkingSetSampler &operator=(const WorkingSetSampler &other) = delete;
+  WorkingSetSampler &operator=(WorkingSetSampler &&other) = delete;
+  
+  /**
+   * CommandDone - count a trace command
+   * 
+   * @return true if a sample is due
+   */
+  bool CommandDone(void) { return ++commands % interval == 0; }
+  
+  /**
+   * SamplePending - true if commands have run since the last sample
+   */
+  bool SamplePending(void) const { return commands % interval != 0; }
+  
+  /**
+   * RecordPage - add one resident page's bits to the current sample
+   * 
+   * @param vaddr virtual address of page
+   * @param accessed Accessed bit
+   * @param modified Modified bit
+   */
+  void RecordPage(mem::Addr vaddr, bool accessed, bool modified);
+  
+  /**
+   * EndSample - close the current sample
+   * 
+   * @param line_number trace line of the last command sampled
+   */
+  void EndSample(long line_number);
+  
+  /**
+   * WriteJson - write the report
+   * 
+   * @param out stream to write to
+   * @param trace_name name of the trace, for the report
+   */
+  void WriteJson(std::ostream &out, const std::string &trace_name) const;
+  
+  // Access to private values
+  uint32_t get_interval(void) const { return interval; }
+  
+  // Size of the virtual regions in the heat map
+  static const mem::Addr kRegionSize = 0x10000;
+  
+private:
+  // One point of the time series
+  struct Sample {
+    uint64_t command;     // commands executed
+    long line_number;     // trace line of last command
+    uint32_t working_set; // pages accessed during the interval
+    uint32_t dirty;       // pages modified during the interval
+    uint32_t resident;    // pages present at the sample
+  };
+  
+  // Intervals in which a page was accessed or modified
+  struct PageHeat {
+    uint32_t accessed;
+    uint32_t modified;
+  };
+  
+  uint32_t interval;
+  uint64_t commands;
+  
+  // Completed samples, and counts for the sample being taken
+  std::vector<Sample> samples;
+  Sample current;
+  
+  // Heat of each page touched (by virtual page number, in address order)
+  std::map<mem::Addr, PageHeat> heat;
+};
+
+#endif /* WORKINGSETSAMPLER_H */
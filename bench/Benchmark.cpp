@@ -0,0 +1,319 @@
+/*
+ * Benchmark - time the trace command handlers and the page frame allocator
+ *
+ * Each workload (see TraceGenerator.h) is generated into a temporary trace
+ * and run on a fresh 256-frame MMU, with its output discarded; the
+ * command statistics (see CommandStats.h) give the time and data moved for
+ * each command type. The allocator is timed separately, taking and
+ * returning frames one at a time and in batches, in both modes.
+ *
+ * Results are written to standard output one per line, tab separated:
+ *
+ *   workload  op  ops  ns_per_op  bytes_per_s
+ *
+ * bytes_per_s is trace data moved (frames cleared, for the allocator) per
+ * second, or "-" if the operation moves none. With -B, a sixth column gives
+ * the speedup over the same line of an earlier run's output. Compares
+ * skipped because they only read back the put before them (see
+ * TraceProgram.h) are reported as op compare_fused, apart from compare.
+ *
+ * Usage: Benchmark [-n iterations] [-r repeats] [-s seed] [-w workload]...
+ *                  [-B baseline_file] [-g trace_file]
+ *   -n N     rounds of each workload's main loop (default 200)
+ *   -r N     run each workload N times, adding up the times (default 3)
+ *   -s N     random seed (default 1)
+ *   -w NAME  run only the named workload ("alloc" for the allocator);
+ *            may be repeated
+ *   -B FILE  compare with the results in FILE
+ *   -g FILE  just write the trace of the (single) -w workload to FILE
+ *
+ * Built from bench/Benchmark.cpp, bench/TraceGenerator.cpp and all the
+ * top-level .cpp files except main.cpp.
+ */
+
+/*
+ * File:   Benchmark.cpp
+ */
+
+#include <MMU.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "../BatchRunner.h"
+#include "../CommandStats.h"
+#include "../PageFrameAllocator.h"
+#include "../ProcessTrace.h"
+#include "TraceGenerator.h"
+
+namespace {
+
+// Name of the allocator pseudo-workload
+const char *const kAllocatorWorkload = "alloc";
+
+void Usage(void) {
+    std::cerr << "usage: Benchmark [-n iterations] [-r repeats] [-s seed] [-w workload]..."
+            << " [-B baseline_file] [-g trace_file]" << std::endl;
+    exit(1);
+}
+
+/*
+ * Benchmark results (ns per op, by workload and op), written out as they
+ * are added, or read back from an earlier run to compare against
+ */
+class Results {
+public:
+    Results(void) : baseline(nullptr) {}
+
+    void set_baseline(const Results *baseline_) { baseline = baseline_; }
+
+    /*
+     * Read results written by Write
+     */
+    bool Read(const std::string &file_name) {
+        std::ifstream in(file_name);
+        if (!in.is_open()) {
+            return false;
+        }
+        std::string line;
+        while (std::getline(in, line)) {
+            std::istringstream fields(line);
+            std::string workload, op;
+            uint64_t ops;
+            double ns_per_op;
+            if (fields >> workload >> op >> ops >> ns_per_op) {
+                ns[workload + "\t" + op] = ns_per_op;
+            }
+        }
+        return true;
+    }
+
+    /*
+     * Add and write out one result
+     */
+    void Write(const std::string &workload, const std::string &op, uint64_t ops,
+            uint64_t total_ns, uint64_t bytes) {
+        if (ops == 0) {
+            return;
+        }
+        std::string key = workload + "\t" + op;
+        double ns_per_op = double(total_ns) / ops;
+        ns[key] = ns_per_op;
+
+        char buffer[64];
+        snprintf(buffer, sizeof(buffer), "\t%.1f\t", ns_per_op);
+        std::cout << key << "\t" << ops << buffer;
+        if (bytes > 0 && total_ns > 0) {
+            std::cout << uint64_t(bytes * 1.0e9 / total_ns);
+        } else {
+            std::cout << "-";
+        }
+        if (baseline) {
+            std::map<std::string, double>::const_iterator old = baseline->ns.find(key);
+            if (old != baseline->ns.end() && ns_per_op > 0) {
+                snprintf(buffer, sizeof(buffer), "\t%.2fx", old->second / ns_per_op);
+                std::cout << buffer;
+            } else {
+                std::cout << "\t-";
+            }
+        }
+        std::cout << "\n";
+    }
+
+private:
+    std::map<std::string, double> ns;
+    const Results *baseline;
+};
+
+/*
+ * Run one workload's trace repeats times, adding up the command statistics
+ */
+bool RunWorkload(TraceGenerator &generator, TraceGenerator::Workload workload,
+        uint32_t iterations, uint32_t repeats, CommandStats &stats) {
+    const char *tmp = getenv("TMPDIR");
+    std::string file_name = std::string(tmp ? tmp : "/tmp") + "/bench."
+            + TraceGenerator::WorkloadName(workload) + "." + std::to_string(getpid());
+    {
+        std::ofstream trace(file_name);
+        generator.Generate(workload, iterations, trace);
+        if (!trace) {
+            std::cerr << "ERROR: failed to write trace file: " << file_name << "\n";
+            return false;
+        }
+    }
+
+    bool ok = true;
+    std::ostream discard(nullptr);
+    for (uint32_t r = 0; r < repeats && ok; ++r) {
+        mem::MMU memory(BatchRunner::kFrameCount);
+        PageFrameAllocator allocator(memory);
+        try {
+            ProcessTrace process(file_name, memory, allocator, discard, std::cerr);
+            process.set_stats(&stats);
+            process.Execute();
+        } catch (TraceError &e) {
+            ok = false;
+        }
+    }
+    remove(file_name.c_str());
+    return ok;
+}
+
+/*
+ * Time the allocator: frames taken and returned one at a time, and in
+ * batches
+ */
+void RunAllocator(PageFrameAllocator::Mode mode, const char *mode_name,
+        uint32_t iterations, uint32_t repeats, Results &results) {
+    const uint32_t kBatch = 16;
+    const uint64_t kFrameBytes = PageFrameAllocator::kPageSize;
+    uint64_t single_alloc_ns = 0, single_free_ns = 0;
+    uint64_t batch_alloc_ns = 0, batch_free_ns = 0;
+    uint64_t singles = 0, batches = 0;
+
+    for (uint32_t r = 0; r < repeats; ++r) {
+        mem::MMU memory(BatchRunner::kFrameCount);
+        PageFrameAllocator allocator(memory, mode);
+        uint32_t frames_per_round = allocator.get_page_frames_free() / kBatch * kBatch;
+        std::vector<uint32_t> frames;
+        frames.reserve(frames_per_round);
+        for (uint32_t i = 0; i < iterations; ++i) {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            for (uint32_t f = 0; f < frames_per_round; ++f) {
+                allocator.Allocate(1, frames);
+            }
+            std::chrono::steady_clock::time_point middle = std::chrono::steady_clock::now();
+            for (uint32_t f = 0; f < frames_per_round; ++f) {
+                allocator.Deallocate(1, frames);
+            }
+            std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+            single_alloc_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(middle - start).count();
+            single_free_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(end - middle).count();
+            singles += frames_per_round;
+
+            start = std::chrono::steady_clock::now();
+            for (uint32_t b = 0; b < frames_per_round / kBatch; ++b) {
+                allocator.Allocate(kBatch, frames);
+            }
+            middle = std::chrono::steady_clock::now();
+            for (uint32_t b = 0; b < frames_per_round / kBatch; ++b) {
+                allocator.Deallocate(kBatch, frames);
+            }
+            end = std::chrono::steady_clock::now();
+            batch_alloc_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(middle - start).count();
+            batch_free_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(end - middle).count();
+            batches += frames_per_round / kBatch;
+        }
+    }
+
+    std::string workload = std::string(kAllocatorWorkload) + "_" + mode_name;
+    results.Write(workload, "Allocate(1)", singles, single_alloc_ns, singles * kFrameBytes);
+    results.Write(workload, "Deallocate(1)", singles, single_free_ns, 0);
+    results.Write(workload, "Allocate(16)", batches, batch_alloc_ns,
+            batches * kBatch * kFrameBytes);
+    results.Write(workload, "Deallocate(16)", batches, batch_free_ns, 0);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    uint32_t iterations = 200;
+    uint32_t repeats = 3;
+    uint32_t seed = 1;
+    std::vector<std::string> selected;
+    std::string baseline_file;
+    std::string trace_file;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:r:s:w:B:g:")) != -1) {
+        switch (opt) {
+            case 'n': iterations = strtoul(optarg, nullptr, 10); break;
+            case 'r': repeats = strtoul(optarg, nullptr, 10); break;
+            case 's': seed = strtoul(optarg, nullptr, 10); break;
+            case 'w': selected.push_back(optarg); break;
+            case 'B': baseline_file = optarg; break;
+            case 'g': trace_file = optarg; break;
+            default: Usage();
+        }
+    }
+    if (optind != argc || iterations == 0 || repeats == 0) {
+        Usage();
+    }
+    for (const std::string &name : selected) {
+        if (name != kAllocatorWorkload
+                && TraceGenerator::LookupWorkload(name) == TraceGenerator::kWorkloadCount) {
+            std::cerr << "ERROR: unknown workload: " << name << "\n";
+            exit(2);
+        }
+    }
+
+    TraceGenerator generator(seed);
+
+    // Generator only
+    if (!trace_file.empty()) {
+        if (selected.size() != 1 || selected[0] == kAllocatorWorkload) {
+            Usage();
+        }
+        std::ofstream trace(trace_file);
+        if (!trace.is_open()) {
+            std::cerr << "ERROR: failed to create trace file: " << trace_file << "\n";
+            exit(2);
+        }
+        generator.Generate(TraceGenerator::LookupWorkload(selected[0]), iterations, trace);
+        return 0;
+    }
+
+    Results baseline;
+    Results results;
+    if (!baseline_file.empty()) {
+        if (!baseline.Read(baseline_file)) {
+            std::cerr << "ERROR: failed to open baseline file: " << baseline_file << "\n";
+            exit(2);
+        }
+        results.set_baseline(&baseline);
+    }
+
+    int status = 0;
+    for (int w = 0; w < TraceGenerator::kWorkloadCount; ++w) {
+        TraceGenerator::Workload workload = static_cast<TraceGenerator::Workload>(w);
+        const char *name = TraceGenerator::WorkloadName(workload);
+        if (!selected.empty() && std::find(selected.begin(), selected.end(), name) == selected.end()) {
+            continue;
+        }
+        CommandStats stats;
+        if (!RunWorkload(generator, workload, iterations, repeats, stats)) {
+            std::cerr << "ERROR: workload failed: " << name << "\n";
+            status = 2;
+            continue;
+        }
+        for (int op = 0; op < BinaryTrace::kOpcodeCount; ++op) {
+            BinaryTrace::Opcode opcode = static_cast<BinaryTrace::Opcode>(op);
+            if (opcode != BinaryTrace::kComment) {
+                results.Write(name, BinaryTrace::OpcodeName(opcode), stats.get_count(opcode),
+                        stats.get_total_ns(opcode), stats.get_bytes(opcode));
+            }
+            // Compares skipped as fused with their put do no work; they
+            // get their own line so compare's ns/op is of real compares
+            if (opcode == BinaryTrace::kCompare) {
+                results.Write(name, "compare_fused", stats.get_count(opcode, true),
+                        stats.get_total_ns(opcode, true), stats.get_bytes(opcode, true));
+            }
+        }
+    }
+
+    if (selected.empty() || std::find(selected.begin(), selected.end(),
+            std::string(kAllocatorWorkload)) != selected.end()) {
+        RunAllocator(PageFrameAllocator::kFreeList, "free_list", iterations, repeats, results);
+        RunAllocator(PageFrameAllocator::kBuddy, "buddy", iterations, repeats, results);
+    }
+    return status;
+}
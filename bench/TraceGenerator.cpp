@@ -0,0 +1,185 @@
+/*
+ * TraceGenerator implementation
+ */
+
+/*
+ * File:   TraceGenerator.cpp
+ */
+
+#include "TraceGenerator.h"
+
+#include <algorithm>
+#include <set>
+#include <vector>
+
+namespace {
+
+const uint32_t kPageSize = 0x1000;
+
+// Bytes mapped by one L2 table
+const uint32_t kL2Span = 0x400000;
+
+const char *const kWorkloadNames[] = {
+  "seq_alloc", "random_alloc", "fill", "copy_storm", "dump_heavy",
+  "put_compare", "writable_toggle"
+};
+
+}  // namespace
+
+TraceGenerator::TraceGenerator(uint32_t seed_)
+: seed(seed_) {
+}
+
+void TraceGenerator::Generate(Workload workload, uint32_t iterations, std::ostream &out) {
+  random.seed(seed + workload);
+  out << std::hex << "# " << WorkloadName(workload) << " x" << iterations << "\n";
+  switch (workload) {
+    case kSequentialAlloc: SequentialAlloc(iterations, out); break;
+    case kRandomAlloc: RandomAlloc(iterations, out); break;
+    case kFill: Fill(iterations, out); break;
+    case kCopyStorm: CopyStorm(iterations, out); break;
+    case kDumpHeavy: DumpHeavy(iterations, out); break;
+    case kPutCompare: PutCompare(iterations, out); break;
+    case kWritableToggle: WritableToggle(iterations, out); break;
+    default: break;
+  }
+  out << std::dec;
+}
+
+TraceGenerator::Workload TraceGenerator::LookupWorkload(const std::string &name) {
+  for (int w = 0; w < kWorkloadCount; ++w) {
+    if (name == kWorkloadNames[w]) {
+      return static_cast<Workload>(w);
+    }
+  }
+  return kWorkloadCount;
+}
+
+const char *TraceGenerator::WorkloadName(Workload workload) {
+  return workload < kWorkloadCount ? kWorkloadNames[workload] : "";
+}
+
+uint32_t TraceGenerator::Random(uint32_t bound) {
+  return std::uniform_int_distribution<uint32_t>(0, bound - 1)(random);
+}
+
+void TraceGenerator::SequentialAlloc(uint32_t iterations, std::ostream &out) {
+  // 8 runs of 8 pages each round (65 frames with the L2 table)
+  const uint32_t base = 0x10000000;
+  for (uint32_t i = 0; i < iterations; ++i) {
+    for (uint32_t run = 0; run < 8; ++run) {
+      out << "alloc " << base + run * 8 * kPageSize << " " << 8 * kPageSize << "\n";
+    }
+    out << "put " << base + Random(64 * kPageSize) << " " << (i & 0xFF) << "\n";
+    out << "free " << base << " " << 64 * kPageSize << "\n";
+  }
+}
+
+void TraceGenerator::RandomAlloc(uint32_t iterations, std::ostream &out) {
+  // 32 pages a round, each in a different L2 table (64 frames)
+  for (uint32_t i = 0; i < iterations; ++i) {
+    std::set<uint32_t> tables;
+    while (tables.size() < 32) {
+      tables.insert(Random(1024));
+    }
+    std::vector<uint32_t> pages;
+    for (uint32_t table : tables) {
+      pages.push_back(table * kL2Span + Random(1024) * kPageSize);
+    }
+    std::shuffle(pages.begin(), pages.end(), random);
+    for (uint32_t page : pages) {
+      out << "alloc " << page << " " << kPageSize << "\n";
+      out << "put " << page + Random(kPageSize) << " " << Random(0x100) << "\n";
+    }
+    for (uint32_t page : pages) {
+      out << "free " << page << " " << kPageSize << "\n";
+    }
+  }
+}
+
+void TraceGenerator::Fill(uint32_t iterations, std::ostream &out) {
+  // 128 pages, filled whole and then in part each round
+  const uint32_t base = 0x400000;
+  const uint32_t size = 128 * kPageSize;
+  out << "alloc " << base << " " << size << "\n";
+  for (uint32_t i = 0; i < iterations; ++i) {
+    out << "fill " << base << " " << size << " " << (i & 0xFF) << "\n";
+    uint32_t offset = Random(size);
+    out << "fill " << base + offset << " " << 1 + Random(size - offset)
+        << " " << Random(0x100) << "\n";
+  }
+}
+
+void TraceGenerator::CopyStorm(uint32_t iterations, std::ostream &out) {
+  // Two regions of 64 pages; 16 copies a round, alternating direction
+  const uint32_t regions[] = { 0x800000, 0xC00000 };
+  const uint32_t size = 64 * kPageSize;
+  out << "alloc " << regions[0] << " " << size << "\n";
+  out << "alloc " << regions[1] << " " << size << "\n";
+  out << "fill " << regions[0] << " " << size << " 5a\n";
+  for (uint32_t i = 0; i < iterations; ++i) {
+    for (uint32_t c = 0; c < 16; ++c) {
+      uint32_t count = 1 + Random(8 * kPageSize);
+      uint32_t dst = regions[c & 1] + Random(size - count + 1);
+      uint32_t src = regions[~c & 1] + Random(size - count + 1);
+      out << "copy " << dst << " " << src << " " << count << "\n";
+    }
+  }
+}
+
+void TraceGenerator::DumpHeavy(uint32_t iterations, std::ostream &out) {
+  // 4 pages of varied bytes; 8 dumps a round
+  const uint32_t base = 0x1000000;
+  const uint32_t size = 4 * kPageSize;
+  out << "alloc " << base << " " << size << "\n";
+  for (uint32_t offset = 0; offset < size; offset += 0x100) {
+    out << "fill " << base + offset << " 100 " << (offset >> 8 & 0xFF) << "\n";
+  }
+  for (uint32_t i = 0; i < iterations; ++i) {
+    for (uint32_t d = 0; d < 8; ++d) {
+      uint32_t count = 0x10 + Random(0x400);
+      out << "dump " << base + Random(size - count + 1) << " " << count << "\n";
+    }
+  }
+}
+
+void TraceGenerator::PutCompare(uint32_t iterations, std::ostream &out) {
+  // 16 pages; 16 puts a round, each followed by a matching compare
+  const uint32_t base = 0x2000000;
+  const uint32_t size = 16 * kPageSize;
+  out << "alloc " << base << " " << size << "\n";
+  std::vector<uint32_t> values;
+  for (uint32_t i = 0; i < iterations; ++i) {
+    for (uint32_t p = 0; p < 16; ++p) {
+      values.resize(1 + Random(16));
+      uint32_t addr = base + Random(size - values.size() + 1);
+      for (uint32_t &value : values) {
+        value = Random(0x100);
+      }
+      for (const char *cmd : { "put ", "compare " }) {
+        out << cmd << addr;
+        for (uint32_t value : values) {
+          out << " " << value;
+        }
+        out << "\n";
+      }
+    }
+  }
+}
+
+void TraceGenerator::WritableToggle(uint32_t iterations, std::ostream &out) {
+  // One page in each of 96 L2 tables (193 frames with the directory); each
+  // round clears and sets Writable across all of them
+  const uint32_t tables = 96;
+  for (uint32_t t = 0; t < tables; ++t) {
+    out << "alloc " << t * kL2Span << " " << kPageSize << "\n";
+  }
+  for (uint32_t i = 0; i < iterations; ++i) {
+    out << "writable 0 " << tables * kL2Span << " 0\n";
+    out << "writable 0 " << tables * kL2Span << " 1\n";
+    for (uint32_t p = 0; p < 4; ++p) {
+      out << "put " << Random(tables) * kL2Span + Random(kPageSize) << " "
+          << Random(0x100) << "\n";
+    }
+  }
+}
@@ -0,0 +1,92 @@
+/*
+ * TraceGenerator - synthetic trace files for benchmarking
+ *
+ * Each workload stresses one part of the simulator. The traces are
+ * ordinary text traces, deterministic for a given seed, and sized to run
+ * in the standard 256-frame memory (see BatchRunner::kFrameCount) without
+ * running out of frames.
+ *
+ *   kSequentialAlloc - alloc and free runs of consecutive pages
+ *   kRandomAlloc     - alloc and free single pages scattered over the
+ *                      address space, each needing its own L2 table
+ *   kFill            - large fills over a contiguous region
+ *   kCopyStorm       - many copies of random size between two regions
+ *   kDumpHeavy       - dumps of random ranges of a small region
+ *   kPutCompare      - short puts, each checked by a compare
+ *   kWritableToggle  - writable on and off over pages spread across many
+ *                      L2 tables, with puts in between
+ */
+
+/*
+ * File:   TraceGenerator.h
+ */
+
+#ifndef TRACEGENERATOR_H
+#define TRACEGENERATOR_H
+
+#include <cstdint>
+#include <ostream>
+#include <random>
+#include <string>
+
+class TraceGenerator {
+public:
+  enum Workload {
+    kSequentialAlloc, kRandomAlloc, kFill, kCopyStorm, kDumpHeavy,
+    kPutCompare, kWritableToggle,
+    kWorkloadCount
+  };
+
+  /**
+   * Constructor
+   *
+   * @param seed_ seed for the random parts of the traces
+   */
+  TraceGenerator(uint32_t seed_);
+
+  virtual ~TraceGenerator(void) {}
+
+  // Disallow copy/move
+  TraceGenerator(const TraceGenerator &other) = delete;
+  TraceGenerator(TraceGenerator &&other) = delete;
+  TraceGenerator &operator=(const TraceGenerator &other) = delete;
+  TraceGenerator &operator=(TraceGenerator &&other) = delete;
+
+  /**
+   * Generate - write a trace for a workload. The same seed, workload and
+   *   iterations always give the same trace.
+   *
+   * @param workload kind of trace
+   * @param iterations number of rounds of the workload's main loop
+   * @param out stream to write trace to
+   */
+  void Generate(Workload workload, uint32_t iterations, std::ostream &out);
+
+  /**
+   * LookupWorkload, WorkloadName - convert between names and workloads
+   *
+   * @return kWorkloadCount if the name is unknown
+   */
+  static Workload LookupWorkload(const std::string &name);
+  static const char *WorkloadName(Workload workload);
+
+private:
+  uint32_t seed;
+  std::mt19937 random;
+
+  /**
+   * Random - uniformly distributed number in [0, bound)
+   */
+  uint32_t Random(uint32_t bound);
+
+  // One generator per workload; same parameters as Generate
+  void SequentialAlloc(uint32_t iterations, std::ostream &out);
+  void RandomAlloc(uint32_t iterations, std::ostream &out);
+  void Fill(uint32_t iterations, std::ostream &out);
+  void CopyStorm(uint32_t iterations, std::ostream &out);
+  void DumpHeavy(uint32_t iterations, std::ostream &out);
+  void PutCompare(uint32_t iterations, std::ostream &out);
+  void WritableToggle(uint32_t iterations, std::ostream &out);
+};
+
+#endif /* TRACEGENERATOR_H */
@@ -1,36 +1,324 @@
 /*
  * Main class for Assignment2
- * The trace file name should be specified as the first (and only) command line
- * argument to the program. 
+ * The trace file names are specified as the command line arguments to the
+ * program. Each trace runs as a separate process sharing one MMU and one
+ * page frame allocator; with more than one trace the processes are
+ * interleaved by the scheduler.
+ *
+ * usage: Assignment2 [options] {trace_file... | -R snapshot_file
+ *                               | -C log_file --seek LINE}
+ *   -f N     simulate N page frames (default 0x100, at most 0x100000 for the
+ *            whole 32-bit physical address space); decimal, or hex with 0x
+ *   -b       use the buddy system page frame allocator
+ *   -l       demand paging: alloc reserves pages, frames are added on first touch
+ *   -z N     keep N pre-zeroed page frames ready
+ *   -q N     time slice in commands (default 16) for multiple traces
+ *   -t       report per-process throughput to standard error (and, with
+ *            --seek, the checkpoint replayed from)
+ *   -j N     batch mode: run each trace on its own MMU, N traces at a time
+ *            (0 for one per core); output is written in trace order
+ *   -L FILE  also read trace file names from FILE, one per line
+ *   -s FILE  when physical memory runs out, evict pages to swap file FILE
+ *            (not with -j)
+ *   -w N     sample working set and page heat every N commands (not with -j)
+ *   -W PFX   working-set reports go to PFX.<n>.json, n numbering the traces
+ *            from 0 (default PFX "workingset")
+ *   -m FILE  write per-command latency histograms and MMU, frame and fault
+ *            counters for all traces to FILE as JSON; the ASSIGNMENT2_STATS
+ *            environment variable names FILE if -m is not given
+ *   -S FILE  run -k commands (over all processes), save a snapshot of the
+ *            machine to FILE and stop (not with -j, -s or -w)
+ *   -k N     commands to run before the snapshot (default 0)
+ *   -R FILE  restore a snapshot and carry on from there, instead of starting
+ *            trace files; frame count, allocator, pre-zeroed pool, time
+ *            slice and demand paging are those of the saved run
+ *   -C FILE  write a checkpoint log of the run to FILE: a checkpoint every -I
+ *            commands, each saving only the frames changed since the last
+ *            (not with -j, -s, -w, -S or -R)
+ *   -I N     commands between checkpoints (default 100000)
+ *   --seek LINE, -G LINE
+ *            restore the last checkpoint in the -C log taken before any
+ *            process executed trace line LINE and replay forward from there,
+ *            instead of starting trace files
  */
 
-/* 
+/*
  * File:   main.cpp
  * Created By: Peter Gish
  * Last Modified: 2/17/18
  */
 
 #include <cstdlib>
+#include <fstream>
+#include <getopt.h>
 #include <iostream>
+#include <memory>
 #include <MMU.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
 
+#include "BatchRunner.h"
+#include "CheckpointLog.h"
+#include "CommandStats.h"
+#include "PageFrameAllocator.h"
+#include "Pager.h"
 #include "ProcessTrace.h"
+#include "Scheduler.h"
+#include "Snapshot.h"
 
 using namespace std;
 
+namespace {
+
+// Frames in the whole 32-bit physical address space. Every frame's
+// address fits in 32 bits; byte counts of multi-frame runs may not, so
+// they are moved in chunks (see PageFrameAllocator::AllocateContiguous).
+const uint32_t kMaxFrameCount = 0x100000;
+
+void Usage(void) {
+    std::cerr << "usage: Assignment2 [-f frames] [-b] [-l] [-z pool_frames] [-q time_slice] [-t]"
+            << " [-j workers] [-L list_file] [-s swap_file]"
+            << " [-w sample_interval] [-W report_prefix] [-m stats_file]"
+            << " [-S snapshot_file [-k commands]] [-C log_file [-I interval]]"
+            << " {-R snapshot_file | -C log_file --seek line | trace_file...}"
+            << std::endl;
+    exit(1);
+}
+
+void WriteStats(const CommandStats *stats, const std::string &stats_file) {
+    if (!stats) {
+        return;
+    }
+    std::ofstream out(stats_file);
+    if (!out.is_open()) {
+        std::cerr << "ERROR: failed to create stats file: " << stats_file << "\n";
+        exit(2);
+    }
+    stats->WriteJson(out);
+}
+
+void SaveSnapshot(const std::string &snapshot_file, mem::MMU &memory,
+                  PageFrameAllocator &allocator, Scheduler &scheduler) {
+    SnapshotWriter out(snapshot_file, memory.get_frame_count(), allocator.get_mode());
+    allocator.Save(out);
+    scheduler.Save(out);
+    if (!out.Close()) {
+        std::cerr << "ERROR: failed to write snapshot file: " << snapshot_file << "\n";
+        exit(2);
+    }
+}
+
+void RunWithCheckpoints(const std::string &log_file, uint64_t interval, mem::MMU &memory,
+                        PageFrameAllocator &allocator, Scheduler &scheduler) {
+    CheckpointLog log(log_file, memory, allocator);
+    uint64_t commands = 0;
+    do {
+        log.Add(commands, scheduler);
+        commands += interval;
+    } while (scheduler.Run(interval));
+    if (!log.Close()) {
+        std::cerr << "ERROR: failed to write checkpoint log: " << log_file << "\n";
+        exit(2);
+    }
+}
+
+// Long options; each has a short form
+const struct option kLongOptions[] = {
+    { "seek", required_argument, nullptr, 'G' },
+    { nullptr, 0, nullptr, 0 }
+};
+
+}  // namespace
+
 /*
  * Create an instance of the MMU class with 256 (0x100) page frames (1MB of simulated
- * physical memory). Do not enable TLB. Need to enable virtual memory mode
- * and construct page tables
+ * physical memory), or as many as -f gives. Do not enable TLB. Need to enable
+ * virtual memory mode and construct page tables
  */
 int main(int argc, char** argv) {
-    mem::MMU mem(0x100);
-    if(argc != 2){
-        std::cerr << "usage: Assignment 2 input_file" << std::endl;
-        exit(1);
-    }
-    ProcessTrace trace(argv[1]);
-    trace.Execute();
-    return 0;
-}
+    uint32_t frame_count = BatchRunner::kFrameCount;
+    PageFrameAllocator::Mode allocator_mode = PageFrameAllocator::kFreeList;
+    bool demand_paging = false;
+    uint32_t zero_pool_frames = 0;
+    uint32_t time_slice = 16;
+    bool report = false;
+    bool batch = false;
+    uint32_t workers = 0;
+    std::vector<std::string> trace_files;
+    std::string swap_file;
+    uint32_t sample_interval = 0;
+    std::string report_prefix = "workingset";
+    std::string stats_file;
+    std::string snapshot_file;
+    uint64_t snapshot_after = 0;
+    std::string restore_file;
+    std::string log_file;
+    uint64_t checkpoint_interval = 100000;
+    long seek_line = 0;
+    if (const char *env_stats = getenv("ASSIGNMENT2_STATS")) {
+        stats_file = env_stats;
+    }
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "f:blz:q:tj:L:s:w:W:m:S:k:R:C:I:G:",
+                              kLongOptions, nullptr)) != -1) {
+        switch (opt) {
+            case 'f': {
+                // Checked before narrowing, so a huge count can't wrap
+                // to one that passes the limit
+                unsigned long count = strtoul(optarg, nullptr, 0);
+                frame_count = count <= kMaxFrameCount ? count : 0;
+                break;
+            }
+            case 'b': allocator_mode = PageFrameAllocator::kBuddy; break;
+            case 'l': demand_paging = true; break;
+            case 'z': zero_pool_frames = strtoul(optarg, nullptr, 10); break;
+            case 'q': time_slice = strtoul(optarg, nullptr, 10); break;
+            case 't': report = true; break;
+            case 'j':
+                batch = true;
+                workers = strtoul(optarg, nullptr, 10);
+                break;
+            case 'L': {
+                std::ifstream list(optarg);
+                if (!list.is_open()) {
+                    std::cerr << "ERROR: failed to open trace list: " << optarg << "\n";
+                    exit(2);
+                }
+                std::string name;
+                while (std::getline(list, name)) {
+                    if (!name.empty()) {
+                        trace_files.push_back(name);
+                    }
+                }
+                break;
+            }
+            case 's': swap_file = optarg; break;
+            case 'w': sample_interval = strtoul(optarg, nullptr, 10); break;
+            case 'W': report_prefix = optarg; break;
+            case 'm': stats_file = optarg; break;
+            case 'S': snapshot_file = optarg; break;
+            case 'k': snapshot_after = strtoull(optarg, nullptr, 10); break;
+            case 'R': restore_file = optarg; break;
+            case 'C': log_file = optarg; break;
+            case 'I': checkpoint_interval = strtoull(optarg, nullptr, 10); break;
+            case 'G': seek_line = strtol(optarg, nullptr, 10); break;
+            default: Usage();
+        }
+    }
+    for (int i = optind; i < argc; ++i) {
+        trace_files.push_back(argv[i]);
+    }
+    bool snapshots = !snapshot_file.empty() || !restore_file.empty() || !log_file.empty();
+    bool seek = seek_line > 0;
+    if (trace_files.empty() == (restore_file.empty() && !seek)
+            || frame_count == 0 || frame_count > kMaxFrameCount
+            || (batch && (!swap_file.empty() || sample_interval > 0))
+            || (snapshots && (batch || !swap_file.empty() || sample_interval > 0))
+            || (!log_file.empty() && (!snapshot_file.empty() || !restore_file.empty()
+                                      || checkpoint_interval == 0))
+            || (seek && log_file.empty())) {
+        Usage();
+    }
+    std::unique_ptr<CommandStats> stats(stats_file.empty() ? nullptr : new CommandStats);
+
+    // Batch mode: independent traces spread over worker threads
+    if (batch) {
+        BatchRunner runner(workers, allocator_mode, demand_paging, zero_pool_frames,
+                           time_slice, frame_count);
+        runner.set_stats(stats.get());
+        for (const std::string &file_name : trace_files) {
+            runner.Add(file_name);
+        }
+        int status = runner.Run(std::cout, std::cerr);
+        runner.Report(std::cerr);
+        WriteStats(stats.get(), stats_file);
+        return status;
+    }
 
+    // A restored machine is the size and kind it was saved as
+    std::unique_ptr<SnapshotReader> snapshot;
+    if (!restore_file.empty() || seek) {
+        const std::string &file_name = seek ? log_file : restore_file;
+        snapshot.reset(new SnapshotReader(file_name));
+        if (!snapshot->ok()) {
+            std::cerr << snapshot->get_error();
+            exit(2);
+        }
+        frame_count = snapshot->get_frame_count();
+        if (frame_count > kMaxFrameCount || snapshot->is_log() != seek) {
+            std::cerr << "ERROR: unsupported snapshot file: " << file_name << "\n";
+            exit(2);
+        }
+        allocator_mode = snapshot->get_mode();
+    }
+
+    mem::MMU mem(frame_count);
+    PageFrameAllocator allocator(mem, allocator_mode);
+    allocator.set_zero_pool_target(zero_pool_frames);
+
+    std::unique_ptr<Pager> pager;
+    if (!swap_file.empty()) {
+        pager.reset(new Pager(mem, allocator, swap_file));
+        if (!pager->is_open()) {
+            std::cerr << "ERROR: failed to create swap file: " << swap_file << "\n";
+            exit(2);
+        }
+    }
+
+    // A trace that can't continue ends the program (the message has been
+    // written already). Statistics are written once the processes are gone.
+    int status = 0;
+    {
+        Scheduler scheduler(time_slice);
+        try {
+            if (snapshot) {
+                Scheduler::ProcessSetup setup = [&stats](ProcessTrace &trace) {
+                    trace.set_stats(stats.get());
+                };
+                uint64_t commands;
+                if (seek ? !CheckpointLog::Restore(*snapshot, seek_line, mem, allocator,
+                                                   scheduler, setup, commands)
+                         : !allocator.Load(*snapshot)
+                           || !scheduler.Load(*snapshot, mem, allocator, setup)) {
+                    std::cerr << "ERROR: corrupt snapshot file or changed trace file: "
+                            << (seek ? log_file : restore_file) << "\n";
+                    exit(2);
+                }
+                if (seek && report) {
+                    std::cerr << "replaying from checkpoint at command " << commands << "\n";
+                }
+                snapshot.reset();
+            }
+            for (size_t i = 0; i < trace_files.size(); ++i) {
+                std::unique_ptr<ProcessTrace> trace(new ProcessTrace(trace_files[i], mem, allocator));
+                trace->set_demand_paging(demand_paging);
+                trace->set_pager(pager.get());
+                trace->set_sampling(sample_interval,
+                        report_prefix + "." + std::to_string(i) + ".json");
+                trace->set_stats(stats.get());
+                scheduler.Add(std::move(trace));
+            }
+            if (!snapshot_file.empty()) {
+                scheduler.Run(snapshot_after);
+                SaveSnapshot(snapshot_file, mem, allocator, scheduler);
+            } else if (!log_file.empty() && !seek) {
+                RunWithCheckpoints(log_file, checkpoint_interval, mem, allocator, scheduler);
+            } else {
+                scheduler.Run();
+            }
+        } catch (TraceError &e) {
+            status = e.get_exit_status();
+        }
+
+        if (status == 0 && report) {
+            scheduler.Report(std::cerr);
+            if (pager) {
+                pager->Report(std::cerr);
+            }
+        }
+    }
+    WriteStats(stats.get(), stats_file);
+    return status;
+}
@@ -0,0 +1,44 @@
+/*
+ * TraceCompiler - convert a text trace file to the compiled binary form
+ * (see BinaryTrace.h). ProcessTrace recognizes compiled traces and replays
+ * them without parsing.
+ * 
+ * Usage: TraceCompiler input_trace output_file
+ * 
+ * Built from tools/TraceCompiler.cpp, BinaryTrace.cpp and TraceReader.cpp.
+ */
+
+/* 
+ * File:   TraceCompiler.cpp
+ */
+
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+
+#include "../BinaryTrace.h"
+#include "../TraceReader.h"
+
+int main(int argc, char** argv) {
+    if (argc != 3) {
+        std::cerr << "usage: TraceCompiler input_trace output_file" << std::endl;
+        exit(1);
+    }
+    TraceReader text(argv[1]);
+    if (!text.is_open()) {
+        std::cerr << "ERROR: failed to open trace file: " << argv[1] << "\n";
+        exit(2);
+    }
+    std::ofstream out(argv[2], std::ios_base::out | std::ios_base::binary
+                               | std::ios_base::trunc);
+    if (!out.is_open()) {
+        std::cerr << "ERROR: failed to create output file: " << argv[2] << "\n";
+        exit(2);
+    }
+    std::string error;
+    if (!BinaryTrace::Compile(text, out, error)) {
+        std::cerr << "ERROR: " << argv[1] << ": " << error << "\n";
+        exit(2);
+    }
+    return 0;
+}